@@ -139,6 +139,17 @@ enum {
 	RASTER_MASK = 0x0F00
 };
 
+enum {
+	ALPHA_OPAQUE,
+	ALPHA_MASK,	// only fully transparent or opaque texels
+	ALPHA_FULL
+};
+
+enum {
+	RESAMPLE_BOX,
+	RESAMPLE_LANCZOS
+};
+
 struct HeaderInfo
 {
 	uint32 type;
@@ -169,6 +180,12 @@ float32 readFloat32(std::istream &rw);
 
 std::string getChunkName(uint32 i);
 
+typedef void (*ParallelFunc)(uint32 index, void *data);
+uint32 numProcessors(void);
+/* calls func for every index below count, 0 threads means one per cpu */
+void parallelFor(uint32 count, ParallelFunc func, void *data,
+                 uint32 numThreads = 0);
+
 /*
  * DFFs
  */
@@ -386,17 +403,50 @@ struct MeshExtension
 	std::vector<float32> unknowns;
 };
 
+/* native chunks as read, written back unchanged as long as the
+ * geometry isn't modified and stays on the same platform */
+struct NativeChunks
+{
+	uint32 platform;	// 0 if there are none
+	uint32 flags;
+	uint32 numUVs;
+	uint32 triangleCount;
+	uint32 vertexCount;
+	uint32 hasPositions;
+	uint32 hasNormals;
+	std::vector<uint8> binMesh;
+	std::vector<uint8> data;
+	std::vector<uint8> skin;
+
+	void clear(void);
+
+	NativeChunks(void);
+};
+
 struct Split
 {
 	uint32 matIndex;
 	std::vector<uint32> indices;	
 };
 
+/* OpenGL native attribute encodings, floats if none is set */
+enum OglEncoding
+{
+	OGL_SHORTUVS = 1,	// 1/512 steps, if they fit
+	OGL_BYTENORMALS = 2,
+	OGL_SHORTNORMALS = 4,
+	OGL_BYTEWEIGHTS = 8,
+	OGL_COMPACT = OGL_SHORTUVS | OGL_BYTENORMALS | OGL_BYTEWEIGHTS
+};
+
 struct Geometry
 {
 	uint32 flags;
 	uint32 numUVs;
 	bool hasNativeGeometry;
+	uint32 nativePlatform;	// write native data for it, 0 is generic
+	uint32 oglEncoding;	// OglEncoding flags
+	NativeChunks rawNative;	// clear it after changing the geometry
 
 	uint32 vertexCount;
 	std::vector<uint16> faces;
@@ -454,6 +504,8 @@ struct Geometry
 	uint32 writeMeshExtension(std::ostream &dff);
 
 	void cleanUp(void);
+	void generateFaces32(std::vector<uint32> &faces32) const;
+	uint32 faceCount(void) const;
 
 	void dump(uint32 index, std::string ind = "", bool detailed = false);
 
@@ -462,16 +514,19 @@ struct Geometry
 	Geometry &operator= (const Geometry &other);
 	~Geometry(void);
 private:
-	void readPs2NativeData(std::istream &dff);
+	void readPs2NativeData(std::istream &dff, int size);
 	void readXboxNativeData(std::istream &dff);
 	void readXboxNativeSkin(std::istream &dff);
 	void readOglNativeData(std::istream &dff, int size);
 	void readNativeSkinMatrices(std::istream &dff);
+	uint32 writePs2NativeData(std::ostream &dff);
+	bool ps2UVsFit(void) const;
+	uint32 writeXboxNativeData(std::ostream &dff);
+	uint32 writeXboxNativeSkin(std::ostream &dff);
+	uint32 writeOglNativeData(std::ostream &dff);
+	uint32 writeNativeSkinMatrices(std::ostream &dff);
 	bool isDegenerateFace(uint32 i, uint32 j, uint32 k);
 	void generateFaces(void);
-	void deleteOverlapping(std::vector<uint32> &typesRead, uint32 split);
-	void readData(uint32 vertexCount, uint32 type, // native data block
-                      uint32 split, std::istream &dff);
 
 	uint32 addTempVertexIfNew(uint32 index);
 };
@@ -526,8 +581,14 @@ struct NativeTexture
 	std::vector<uint32> dataSizes;
 	std::vector<uint8*> texels;	// holds either indices or color values
 					// (also per mipmap)
+	std::vector<uint32> dataOffsets;// stream position of the texels
 	uint8 *palette;
 	uint32 paletteSize;
+	uint32 paletteOffset;
+
+	// palette and texels point into this
+	uint8 *buffer;
+	uint32 bufferSize;
 
 	bool hasAlpha;
 	uint32 mipmapCount;
@@ -544,11 +605,18 @@ struct NativeTexture
 	uint32 dxtCompression;
 
 	/* functions */
-	void readD3d(std::istream &txd);
-	void readPs2(std::istream &txd);
-	void readXbox(std::istream &txd);
+	void readD3d(std::istream &txd, bool loadData = true);
+	void readPs2(std::istream &txd, bool loadData = true);
+	void readXbox(std::istream &txd, bool loadData = true);
+	bool loadTexels(std::istream &txd);
+	uint8 *resizeTexels(bool inPlace = false);
 	uint32 writeD3d(std::ostream &txd);
-	void writeTGA(void);
+	uint32 writePs2(std::ostream &txd);
+	uint32 writeXbox(std::ostream &txd);
+	bool writeTGA(const std::string &path, bool rle = false);
+	bool writeDDS(const std::string &path);
+	bool readTGA(const std::string &path);
+	bool readDDS(const std::string &path);
 
 	void convertFromPS2(uint32 aref);
 	void processPs2Swizzle(uint32 mip);
@@ -558,22 +626,98 @@ struct NativeTexture
 	void decompressDxt3(void);
 	void decompressDxt4(void);
 	void convertTo32Bit(void);
+	bool convertToFormat(uint32 format);
+	bool convertToPalette(uint32 format, bool lossy);
+	uint32 classifyAlpha(void);
+	bool fitAlphaFormat(void);
+	bool compressDxt(uint32 dxt);
+	bool resample(uint32 newWidth, uint32 newHeight,
+	              uint32 filter = RESAMPLE_BOX);
 
 	NativeTexture(void);
 	NativeTexture(const NativeTexture &orig);
 	NativeTexture &operator=(const NativeTexture &that);
+#if __cplusplus >= 201103L
+	NativeTexture(NativeTexture &&orig) noexcept;
+	NativeTexture &operator=(NativeTexture &&that) noexcept;
+#endif
+	void swap(NativeTexture &that);
 	~NativeTexture(void);
 };
 
+struct RasterFormatInfo
+{
+	uint32 depth;		// bits per pixel
+	uint32 shift[4];	// R, G, B, A
+	uint32 bits[4];		// 0 if the channel doesn't exist
+};
+
+const RasterFormatInfo *getRasterFormatInfo(uint32 rasterFormat);
+
+/* raster conversion kernels, dst has to hold n pixels of dstFormat */
+bool expandPalette(uint8 *dst, const uint8 *src, uint32 n, uint32 depth,
+                   const uint8 *palette, uint32 paletteSize,
+                   uint32 dstFormat);
+bool convertPixels(uint8 *dst, const uint8 *src, uint32 n,
+                   uint32 srcFormat, uint32 dstFormat);
+/* one of the ALPHA_ classes, pixels are 8888 */
+uint32 classifyAlpha(const uint8 *pixels, uint32 n);
+/* palette quantization, pixels are 8888 and the palette RGBA */
+uint32 makePalette(uint8 *palette, uint32 maxColors,
+                   const uint8 *pixels, uint32 n, bool lossy);
+void mapToPalette(uint8 *dst, const uint8 *pixels, uint32 width,
+                  uint32 height, const uint8 *palette, uint32 paletteSize,
+                  bool dither);
+/* 8888 pixels, dst has to hold dstWidth*dstHeight pixels */
+void resamplePixels(uint8 *dst, uint32 dstWidth, uint32 dstHeight,
+                    const uint8 *src, uint32 srcWidth, uint32 srcHeight,
+                    uint32 filter);
+/* 8888 pixels to DXT1, 3 or 5 blocks, partial blocks are padded;
+ * punchThrough makes DXT1 texels with alpha below 0x80 transparent */
+void compressDxt(uint8 *dst, const uint8 *pixels, uint32 width,
+                 uint32 height, uint32 dxt, bool punchThrough);
+/* PS2 4 and 8 bit indices in and out of PSMT8 order, one byte per
+ * unswizzled index; stride is the swizzled width in texels */
+void unswizzlePs2(uint8 *dst, const uint8 *src, uint32 width,
+                  uint32 height, uint32 stride, uint32 depth, bool swizzled);
+void swizzlePs2(uint8 *dst, const uint8 *src, uint32 width, uint32 height,
+                uint32 stride, uint32 depth, bool swizzled);
+/* Xbox Morton order, for 8, 16 and 32 bit texels */
+bool unswizzleXbox(uint8 *dst, const uint8 *src, uint32 width,
+                   uint32 height, uint32 depth);
+bool swizzleXbox(uint8 *dst, const uint8 *src, uint32 width,
+                 uint32 height, uint32 depth);
+
+typedef void (*TextureCallback)(NativeTexture &tex, uint32 index,
+                                void *data);
+
 struct TextureDictionary
 {
 	std::vector<NativeTexture> texList;
 
 	/* functions */
-	void read(std::istream &txd);
+	void read(std::istream &txd, bool loadData = true);
 	uint32 write(std::ostream &txd);
 	void clear(void);
 	~TextureDictionary(void);
+
+	/* reads one texture at a time, each is freed after the callback */
+	static uint32 readStream(std::istream &txd, TextureCallback callback,
+	                         void *data, bool loadData = true);
+};
+
+/* writes a texture dictionary one texture at a time */
+struct TextureDictionaryWriter
+{
+	std::ostream *rw;
+	uint32 headerPos;
+	uint32 countPos;
+	uint32 bytesWritten;
+	uint32 textureCount;
+
+	void begin(std::ostream &txd);
+	void write(NativeTexture &tex);
+	uint32 end(void);
 };
 
 struct UVAnimation
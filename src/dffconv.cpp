@@ -99,13 +99,19 @@ usage(void)
 {
 	cerr << "usage: " << argv0 <<
 	        " [-d] [-dd]" <<
-	        " [-c] [-v version_string] [-V version] " <<
+	        " [-c] [-v version_string] [-V version] [-o platform]" <<
+	        " [-e encodings]" <<
 	        " in_dff out_dff\n";
 	cerr << "-c: Clean up geometries; advised for PS2 dffs.\n";
 	cerr << "-m: Fix environment and specular material of PS2 dffs " <<
 	        "according to pipeline used.\n";
 	cerr << "-v: Known versions: GTA3, GTAVC_1, GTAVC_2, GTASA\n";
 	cerr << "-V: Set any version you like in hexadecimal.\n";
+	cerr << "-o: Write native geometry for platform: ps2, xbox, ogl, " <<
+	        "native (keep the input's); default is generic.\n";
+	cerr << "-e: OpenGL attribute encodings, comma separated: " <<
+	        "uv16, normal8, normal16, weight8, compact; " <<
+	        "default is float.\n";
 	cerr << "-d: Dump dff data.\n";
 	cerr << "-dd: Dump dff data detailed.\n";
 	exit(1);
@@ -154,6 +160,11 @@ main(int argc, char *argv[])
 	int cleanflag = 0;
 	int dumpflag = 0;
 	int fixmatflag = 0;
+	uint32 platform = 0;
+	int keepplatform = 0;
+	string platstring;
+	uint32 encoding = 0;
+	string encstring;
 	ARGBEGIN{
 	case 'v':
 		verstring = EARGF(usage());
@@ -183,6 +194,45 @@ main(int argc, char *argv[])
 	case 't':
 		typestr = EARGF(usage());
 		break;
+	case 'o':
+		platstring = EARGF(usage());
+		keepplatform = platstring == "native";
+		if(platstring == "ps2")
+			platform = PLATFORM_PS2;
+		else if(platstring == "xbox")
+			platform = PLATFORM_XBOX;
+		else if(platstring == "ogl")
+			platform = PLATFORM_OGL;
+		else if(platstring == "generic" || keepplatform)
+			platform = 0;
+		else{
+			cerr << "unknown platform " << platstring << endl;
+			return 1;
+		}
+		break;
+	case 'e':
+		encstring = EARGF(usage());
+		encstring += ',';
+		for(size_t pos = 0; pos < encstring.size();){
+			size_t end = encstring.find(',', pos);
+			string enc = encstring.substr(pos, end-pos);
+			pos = end+1;
+			if(enc == "uv16")
+				encoding |= OGL_SHORTUVS;
+			else if(enc == "normal8")
+				encoding |= OGL_BYTENORMALS;
+			else if(enc == "normal16")
+				encoding |= OGL_SHORTNORMALS;
+			else if(enc == "weight8")
+				encoding |= OGL_BYTEWEIGHTS;
+			else if(enc == "compact")
+				encoding |= OGL_COMPACT;
+			else if(enc != "float"){
+				cerr << "unknown encoding " << enc << endl;
+				return 1;
+			}
+		}
+		break;
 	default:
 		usage();
 	}ARGEND;
@@ -235,8 +285,21 @@ main(int argc, char *argv[])
 
 			if(dumpflag)
 				clump->dump(dumpflag > 1);
+
+			for(uint32 i = 0; i < clump->geometryList.size(); i++){
+				if(!keepplatform)
+					clump->geometryList[i].nativePlatform =
+					  platform;
+				clump->geometryList[i].oglEncoding = encoding;
+			}
 		
-			clump->write(out);
+			if(clump->write(out) == 0){
+				cerr << "cannot write " << argv[1] << endl;
+				delete clump;
+				out.close();
+				remove(argv[1]);
+				return 1;
+			}
 			delete clump;
 		}else if(header.type == CHUNK_UVANIMDICT){
 			in.seekg(-12, ios::cur);
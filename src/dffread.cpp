@@ -344,11 +344,15 @@ void Geometry::read(istream &rw)
 	READ_HEADER(CHUNK_STRUCT);
 	flags = readUInt16(rw);
 	numUVs = readUInt8(rw);
+	rawNative.flags = flags;
+	rawNative.numUVs = numUVs;
 	if (flags & FLAGS_TEXTURED)
 		numUVs = 1;
 	hasNativeGeometry = readUInt8(rw);
 	uint32 triangleCount = readUInt32(rw);
 	vertexCount = readUInt32(rw);
+	rawNative.triangleCount = triangleCount;
+	rawNative.vertexCount = vertexCount;
 	rw.seekg(4, ios::cur); /* number of morph targets, uninteresting */
 	// skip light info
 	if (header.version < 0x34000)
@@ -381,6 +385,8 @@ void Geometry::read(istream &rw)
 	//hasPositions = (flags & FLAGS_POSITIONS) ? 1 : 0;
 	hasPositions = readUInt32(rw);
 	hasNormals = readUInt32(rw);
+	rawNative.hasPositions = hasPositions;
+	rawNative.hasNormals = hasNormals;
 	// need to recompute:
 	hasPositions = 1;
 	hasNormals = (flags & FLAGS_NORMALS) ? 1 : 0;
@@ -408,6 +414,20 @@ void Geometry::read(istream &rw)
 	readExtension(rw);
 }
 
+/* keeps a copy of the chunk data, the stream stays where it was */
+static void
+readRawChunk(istream &rw, vector<uint8> &raw, uint32 size)
+{
+	streampos beg = rw.tellg();
+	raw.resize(size);
+	if(size > 0){
+		rw.read((char *) &raw[0], size);
+		raw.resize(rw.gcount());
+	}
+	rw.clear();
+	rw.seekg(beg, ios::beg);
+}
+
 void
 Geometry::readExtension(istream &rw)
 {
@@ -422,6 +442,9 @@ Geometry::readExtension(istream &rw)
 		header.read(rw);
 		switch(header.type){
 		case CHUNK_BINMESH: {
+			if(hasNativeGeometry)
+				readRawChunk(rw, rawNative.binMesh,
+				             header.length);
 			faceType = readUInt32(rw);
 			uint32 numSplits = readUInt32(rw);
 			numIndices = readUInt32(rw);
@@ -448,21 +471,27 @@ Geometry::readExtension(istream &rw)
 			streampos beg = rw.tellg();
 			uint32 size = header.length;
 			uint32 build = header.build;
+			readRawChunk(rw, rawNative.data, size);
 			header.read(rw);
 			if(header.build==build && header.type==CHUNK_STRUCT){
 				uint32 platform = readUInt32(rw);
 				rw.seekg(beg, ios::beg);
 				if(platform == PLATFORM_PS2)
-					readPs2NativeData(rw);
+					readPs2NativeData(rw, size);
 				else if(platform == PLATFORM_XBOX)
 					readXboxNativeData(rw);
 				else
 					cout << "unknown platform " <<
 					        platform << endl;
+				if(platform == PLATFORM_PS2 ||
+				   platform == PLATFORM_XBOX)
+					rawNative.platform = platform;
 			}else{
 				rw.seekg(beg, ios::beg);
 				readOglNativeData(rw, size);
+				rawNative.platform = PLATFORM_OGL;
 			}
+			nativePlatform = rawNative.platform;
 			break;
 		}
 		case CHUNK_MESHEXTENSION: {
@@ -495,6 +524,8 @@ Geometry::readExtension(istream &rw)
 		} case CHUNK_SKIN: {
 			if(hasNativeGeometry){
 				streampos beg = rw.tellg();
+				readRawChunk(rw, rawNative.skin,
+				             header.length);
 				rw.seekg(0x0c, ios::cur);
 				uint32 platform = readUInt32(rw);
 				rw.seekg(beg, ios::beg);
@@ -660,35 +691,141 @@ bool Geometry::isDegenerateFace(uint32 i, uint32 j, uint32 k)
 	return false;
 }
 
+/*
+ * Face generation counts the triangles of every split first, so the
+ * splits can fill their own parts of the preallocated array in parallel.
+ */
+
+/* below this many indices threads cost more than they save */
+#define FACES_PARALLEL_MIN 0x10000
+
+/* strip triangles that repeat an index only restart the strip */
+static inline bool isStripRestart(const uint32 *idx)
+{
+	return idx[0] == idx[1] || idx[0] == idx[2] || idx[1] == idx[2];
+}
+
+template <typename T>
+struct FaceJob
+{
+	const Geometry *geo;
+	uint32 *counts;		// faces per split, then offsets
+	T *faces;
+};
+
+template <typename T>
+static void countFaces(uint32 i, void *data)
+{
+	FaceJob<T> *job = (FaceJob<T> *) data;
+	const vector<uint32> &idx = job->geo->splits[i].indices;
+	uint32 n = idx.size();
+	uint32 count = 0;
+	if (job->geo->faceType != FACETYPE_STRIP)
+		count = n/3;
+	else
+		for (uint32 j = 0; j+2 < n; j++)
+			if (!isStripRestart(&idx[j]))
+				count++;
+	job->counts[i] = count;
+}
+
+template <typename T>
+static void fillFaces(uint32 i, void *data)
+{
+	FaceJob<T> *job = (FaceJob<T> *) data;
+	const Split &s = job->geo->splits[i];
+	const vector<uint32> &idx = s.indices;
+	uint32 n = idx.size();
+	T *f = job->faces + job->counts[i]*4;
+	if (job->geo->faceType == FACETYPE_STRIP)
+		for (uint32 j = 0; j+2 < n; j++) {
+			if (isStripRestart(&idx[j]))
+				continue;
+			/* every other triangle is flipped */
+			f[0] = idx[j+1 + (j%2)];
+			f[1] = idx[j+0];
+			f[2] = s.matIndex;
+			f[3] = idx[j+2 - (j%2)];
+			f += 4;
+		}
+	else
+		for (uint32 j = 0; j+2 < n; j += 3) {
+			f[0] = idx[j+1];
+			f[1] = idx[j+0];
+			f[2] = s.matIndex;
+			f[3] = idx[j+2];
+			f += 4;
+		}
+}
+
+/* counts the faces of every split and turns the counts into offsets,
+ * returns the total */
+template <typename T>
+static uint32 offsetFaces(FaceJob<T> &job, vector<uint32> &counts,
+                          uint32 &threads)
+{
+	const Geometry &g = *job.geo;
+	uint32 numSplits = g.splits.size();
+	uint32 numIndices = 0;
+	for (uint32 i = 0; i < numSplits; i++)
+		numIndices += g.splits[i].indices.size();
+	threads = numIndices < FACES_PARALLEL_MIN ? 1 : 0;
+
+	counts.assign(numSplits+1, 0);
+	job.counts = &counts[0];
+	parallelFor(numSplits, countFaces<T>, &job, threads);
+
+	uint32 total = 0;
+	for (uint32 i = 0; i < numSplits; i++) {
+		uint32 n = counts[i];
+		counts[i] = total;
+		total += n;
+	}
+	return total;
+}
+
+template <typename T>
+static void buildFaces(const Geometry &g, vector<T> &faces)
+{
+	vector<uint32> counts;
+	uint32 threads;
+	FaceJob<T> job;
+	job.geo = &g;
+	uint32 total = offsetFaces(job, counts, threads);
+
+	faces.resize(total*4);
+	if (total == 0)
+		return;
+	job.faces = &faces[0];
+	parallelFor(g.splits.size(), fillFaces<T>, &job, threads);
+}
+
 // native console data doesn't have face information, use this to generate it
 void Geometry::generateFaces(void)
 {
 	faces.clear();
-
-	for (uint32 i = 0; i < splits.size(); i++) {
-		Split &s = splits[i];
-		if (faceType == FACETYPE_STRIP)
-			for (uint32 j = 0; j < s.indices.size()-2; j++) {
-//				if (isDegenerateFace(s.indices[j+0],
-//				    s.indices[j+1], s.indices[j+2]))
-//					continue;
-				if(s.indices[j+0] == s.indices[j+1] ||
-				   s.indices[j+0] == s.indices[j+2] ||
-				   s.indices[j+1] == s.indices[j+2])
-					continue;
-				faces.push_back(s.indices[j+1 + (j%2)]);
-				faces.push_back(s.indices[j+0]);
-				faces.push_back(s.matIndex);
-				faces.push_back(s.indices[j+2 - (j%2)]);
-			}
-		else
-			for (uint32 j = 0; j < s.indices.size()-2; j+=3) {
-				faces.push_back(s.indices[j+1]);
-				faces.push_back(s.indices[j+0]);
-				faces.push_back(s.matIndex);
-				faces.push_back(s.indices[j+2]);
-			}
+	if (vertices.size()/3 > 0x10000) {
+		cerr << filename << ": too many vertices for 16 bit faces\n";
+		return;
 	}
+	buildFaces(*this, faces);
+}
+
+// same layout as faces, for geometries with more than 0x10000 vertices
+void Geometry::generateFaces32(vector<uint32> &faces32) const
+{
+	buildFaces(*this, faces32);
+}
+
+// the number of faces generateFaces would make, without making them
+uint32 Geometry::faceCount(void) const
+{
+	vector<uint32> counts;
+	uint32 threads;
+	FaceJob<uint32> job;
+	job.geo = this;
+	job.faces = 0;
+	return offsetFaces(job, counts, threads);
 }
 
 // these hold the (temporary) cleaned up data
@@ -800,6 +937,8 @@ uint32 Geometry::addTempVertexIfNew(uint32 index)
 // removes duplicate vertices (only useful with ps2 meshes)
 void Geometry::cleanUp(void)
 {
+	rawNative.clear();
+
 	vertices_new.clear();
 	normals_new.clear();
 	vertexColors_new.clear();
@@ -977,7 +1116,8 @@ void Geometry::dump(uint32 index, string ind, bool detailed)
 }
 
 Geometry::Geometry(void)
-: flags(0), numUVs(0), hasNativeGeometry(false), vertexCount(0),
+: flags(0), numUVs(0), hasNativeGeometry(false), nativePlatform(0),
+  oglEncoding(0), vertexCount(0),
   hasNormals(false), faceType(0), numIndices(0), hasSkin(false), boneCount(0),
   specialIndexCount(0), unknown1(0), unknown2(0), hasMeshExtension(false),
   meshExtension(0), hasNightColors(false), nightColorsUnknown(0),
@@ -987,7 +1127,9 @@ Geometry::Geometry(void)
 
 Geometry::Geometry(const Geometry &orig)
 : flags(orig.flags), numUVs(orig.numUVs),
-  hasNativeGeometry(orig.hasNativeGeometry), vertexCount(orig.vertexCount),
+  hasNativeGeometry(orig.hasNativeGeometry),
+  nativePlatform(orig.nativePlatform), oglEncoding(orig.oglEncoding),
+  rawNative(orig.rawNative), vertexCount(orig.vertexCount),
   faces(orig.faces), vertexColors(orig.vertexColors),
   hasPositions(orig.hasPositions), hasNormals(orig.hasNormals),
   vertices(orig.vertices), normals(orig.normals),
@@ -1020,6 +1162,9 @@ Geometry &Geometry::operator=(const Geometry &that)
 		flags = that.flags;
 		numUVs = that.numUVs;
 		hasNativeGeometry = that.hasNativeGeometry;
+		nativePlatform = that.nativePlatform;
+		oglEncoding = that.oglEncoding;
+		rawNative = that.rawNative;
 
 		vertexCount = that.vertexCount;
 		faces = that.faces;
@@ -1072,6 +1217,20 @@ Geometry::~Geometry(void)
 	delete meshExtension;
 }
 
+NativeChunks::NativeChunks(void)
+: platform(0), flags(0), numUVs(0), triangleCount(0), vertexCount(0),
+  hasPositions(0), hasNormals(0)
+{
+}
+
+void NativeChunks::clear(void)
+{
+	platform = 0;
+	binMesh.clear();
+	data.clear();
+	skin.clear();
+}
+
 
 /*
  * Material
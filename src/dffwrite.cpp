@@ -88,8 +88,13 @@ uint32 Clump::write(ostream &rw)
 		bytesWritten += writtenBytesReturn;
 
 		// Geometries
-		for (uint32 i = 0; i < geometryList.size(); i++)
-			bytesWritten += geometryList[i].write(rw);
+		for (uint32 i = 0; i < geometryList.size(); i++) {
+			// a geometry that can't be written fails the clump
+			uint32 n = geometryList[i].write(rw);
+			if (n == 0)
+				return 0;
+			bytesWritten += n;
+		}
 
 		WRITE_HEADER(CHUNK_GEOMETRYLIST);
 	}
@@ -301,12 +306,68 @@ uint32 Frame::writeExtension(ostream &rw)
  * Geometry
  */
 
+/* writes back a chunk kept by the reader, a struct inside it
+ * gets the current build too */
+static uint32 writeRawChunk(ostream &rw, uint32 type,
+                            const vector<uint8> &raw, bool hasStruct)
+{
+	HeaderInfo header;
+	header.build = version;
+	header.type = type;
+	header.length = raw.size();
+	uint32 bytesWritten = header.write(rw);
+
+	uint32 pos = 0;
+	if (hasStruct && raw.size() >= 12) {
+		rw.write((char *) &raw[0], 8);
+		bytesWritten += 8;
+		bytesWritten += writeUInt32(version, rw);
+		pos = 12;
+	}
+	if (raw.size() > pos)
+		rw.write((char *) &raw[pos], raw.size() - pos);
+	bytesWritten += raw.size() - pos;
+	return bytesWritten;
+}
+
 uint32 Geometry::write(ostream &rw)
 {
 	HeaderInfo header;
 	header.build = version;
 	uint32 writtenBytesReturn;
 
+	/* unchanged native geometry is written as it was read */
+	bool raw = rawNative.platform != 0 &&
+	           rawNative.platform == nativePlatform;
+	bool native = nativePlatform == PLATFORM_PS2 ||
+	              nativePlatform == PLATFORM_XBOX ||
+	              nativePlatform == PLATFORM_OGL;
+	if (native && !raw && splits.size() == 0) {
+		cerr << "no bin mesh, writing generic geometry\n";
+		native = false;
+	}
+	/* ogl has only one uv set */
+	if (native && !raw && nativePlatform == PLATFORM_OGL &&
+	    (flags & FLAGS_TEXTURED2) && numUVs > 1) {
+		cerr << "more than one uv set, writing generic geometry\n";
+		native = false;
+	}
+	/* ps2 has two uv sets only as 16 bit integers */
+	if (native && !raw && nativePlatform == PLATFORM_PS2 && !ps2UVsFit()) {
+		cerr << "uv sets don't fit ps2 native data, "
+		        "writing generic geometry\n";
+		native = false;
+	}
+	bool ps2 = native && nativePlatform == PLATFORM_PS2;
+	bool ogl = native && nativePlatform == PLATFORM_OGL;
+	/* xbox and ogl indices are 16 bit, so are generated generic faces */
+	bool bigIndices = !raw && vertices.size()/3 > 0x10000;
+	if (bigIndices && !ps2 && (native || faces.size() == 0)) {
+		cerr << "too many vertices for 16 bit indices, "
+		        "not writing geometry\n";
+		return 0;
+	}
+
 	// Geometry
 	SKIP_HEADER();
 
@@ -314,22 +375,32 @@ uint32 Geometry::write(ostream &rw)
 	{
 		SKIP_HEADER();
 
-		if (faces.size() == 0)
+		if (faces.size() == 0 && !raw && !bigIndices)
 			generateFaces();
 
-		bytesWritten += writeUInt16(flags, rw);
-		if (flags & FLAGS_TEXTURED2)
+		bytesWritten += writeUInt16(raw ? rawNative.flags : flags, rw);
+		if (raw)
+			bytesWritten += writeUInt8(rawNative.numUVs, rw);
+		else if (flags & FLAGS_TEXTURED2)
 			bytesWritten += writeUInt8(numUVs, rw);
 		else
 			bytesWritten += writeUInt8(0, rw);
 
-		/* we can't write native geometry */
-		bytesWritten += writeUInt8(0, rw);
+		bytesWritten += writeUInt8(native, rw);
 
 		uint32 triangleCount = faces.size() / 4;
+		/* ps2 data only needs the number of faces */
+		if (bigIndices && faces.size() == 0)
+			triangleCount = faceCount();
 		vertexCount = vertices.size() / 3;
-		bytesWritten += writeUInt32(triangleCount, rw);
-		bytesWritten += writeUInt32(vertexCount, rw);
+		if (raw) {
+			bytesWritten += writeUInt32(rawNative.triangleCount,
+			                            rw);
+			bytesWritten += writeUInt32(rawNative.vertexCount, rw);
+		} else {
+			bytesWritten += writeUInt32(triangleCount, rw);
+			bytesWritten += writeUInt32(vertexCount, rw);
+		}
 		/* morph targets are always just 1 */
 		bytesWritten += writeUInt32(1, rw);
 
@@ -341,17 +412,18 @@ uint32 Geometry::write(ostream &rw)
 			bytesWritten += writeFloat32(1.0f, rw);
 		}
 
-		if (flags & FLAGS_PRELIT) {
+		/* native data holds the vertices */
+		if (flags & FLAGS_PRELIT && !native) {
 			rw.write((char *) (&vertexColors[0]),
 			         4*vertexCount*sizeof(uint8));
 			bytesWritten += 4*vertexCount*sizeof(uint8);
 		}
-		if (flags & FLAGS_TEXTURED) {
+		if (flags & FLAGS_TEXTURED && !native) {
 			rw.write((char *) (&texCoords[0][0]),
 			         2*vertexCount*sizeof(float32));
 			bytesWritten += 2*vertexCount*sizeof(float32);
 		}
-		if (flags & FLAGS_TEXTURED2) {
+		if (flags & FLAGS_TEXTURED2 && !native) {
 			for (uint32 i = 0; i < numUVs; i++) {
 				rw.write((char *)
 				          (&texCoords[i][0]),
@@ -359,22 +431,31 @@ uint32 Geometry::write(ostream &rw)
 				bytesWritten += 2*vertexCount*sizeof(float32);
 			}
 		}
-		rw.write((char *) (&faces[0]),
-		         4*triangleCount*sizeof(uint16));
-		bytesWritten += 4*triangleCount*sizeof(uint16);
+		if (!native && triangleCount > 0) {
+			rw.write((char *) (&faces[0]),
+			         4*triangleCount*sizeof(uint16));
+			bytesWritten += 4*triangleCount*sizeof(uint16);
+		}
 
 		// Morph Targets (always 1)
 		// Bounding Sphere
 		rw.write((char *) boundingSphere, 4*sizeof(float32));
 		bytesWritten += 4*sizeof(float32);
 
-		bytesWritten += writeUInt32(hasPositions, rw);
-		bytesWritten += writeUInt32(hasNormals, rw);
-		rw.write((char *) (&vertices[0]),
-		         3*vertexCount*sizeof(float32));
-		bytesWritten += 3*vertexCount*sizeof(float32);
+		if (raw) {
+			bytesWritten += writeUInt32(rawNative.hasPositions, rw);
+			bytesWritten += writeUInt32(rawNative.hasNormals, rw);
+		} else {
+			bytesWritten += writeUInt32(hasPositions, rw);
+			bytesWritten += writeUInt32(hasNormals, rw);
+		}
+		if (!native) {
+			rw.write((char *) (&vertices[0]),
+			         3*vertexCount*sizeof(float32));
+			bytesWritten += 3*vertexCount*sizeof(float32);
+		}
 
-		if (flags & FLAGS_NORMALS) {
+		if (flags & FLAGS_NORMALS && !native) {
 			rw.write((char *) (&normals[0]),
 				 3*vertexCount*sizeof(float32));
 			bytesWritten += 3*vertexCount*sizeof(float32);
@@ -411,7 +492,10 @@ uint32 Geometry::write(ostream &rw)
 		SKIP_HEADER();
 
 		// Bin Mesh
-		{
+		if (raw) {
+			writtenBytesReturn = writeRawChunk(rw, CHUNK_BINMESH,
+			                          rawNative.binMesh, false);
+		} else {
 			SKIP_HEADER();
 			bytesWritten += writeUInt32(faceType, rw);
 			bytesWritten += writeUInt32(splits.size(), rw);
@@ -421,6 +505,13 @@ uint32 Geometry::write(ostream &rw)
 				bytesWritten += writeUInt32(indexCount, rw);
 				bytesWritten += writeUInt32(splits[i].matIndex,
 				                            rw);
+				/* ogl keeps 16 bit indices here */
+				if (ogl)
+					for (uint32 j = 0; j < indexCount; j++)
+						bytesWritten += writeUInt16(
+						  splits[i].indices[j], rw);
+				if (native)
+					continue;
 				for (uint32 j = 0; j < indexCount; j++)
 					bytesWritten += writeUInt32(
 					  splits[i].indices[j], rw);
@@ -429,6 +520,18 @@ uint32 Geometry::write(ostream &rw)
 		}
 		bytesWritten += writtenBytesReturn;
 
+		// Native Data
+		if (raw)
+			bytesWritten += writeRawChunk(rw, CHUNK_NATIVEDATA,
+			                   rawNative.data,
+			                   rawNative.platform != PLATFORM_OGL);
+		else if (ps2)
+			bytesWritten += writePs2NativeData(rw);
+		else if (ogl)
+			bytesWritten += writeOglNativeData(rw);
+		else if (native)
+			bytesWritten += writeXboxNativeData(rw);
+
 		// Mesh extension
 		if (hasMeshExtension)
 			bytesWritten += writeMeshExtension(rw);
@@ -438,7 +541,8 @@ uint32 Geometry::write(ostream &rw)
 		if (hasNightColors) {
 			SKIP_HEADER();
 			bytesWritten += writeUInt32(nightColorsUnknown, rw);
-			if (nightColorsUnknown != 0) {
+			/* ps2 native data has them too */
+			if (nightColorsUnknown != 0 && !ps2) {
 				rw.write((char *) (&nightColors[0]),
 				   nightColors.size()*sizeof(uint8));
 				bytesWritten+= nightColors.size()*sizeof(uint8);
@@ -459,7 +563,19 @@ uint32 Geometry::write(ostream &rw)
 
 		// Skin
 		writtenBytesReturn = 0;
-		if (hasSkin) {
+		if (hasSkin && raw && rawNative.skin.size() > 0) {
+			writtenBytesReturn = writeRawChunk(rw, CHUNK_SKIN,
+			                                   rawNative.skin, true);
+		} else if (hasSkin && native) {
+			SKIP_HEADER();
+			/* ps2 and ogl keep weights and indices
+			 * in the native data */
+			if (ps2 || ogl)
+				bytesWritten += writeNativeSkinMatrices(rw);
+			else
+				bytesWritten += writeXboxNativeSkin(rw);
+			WRITE_HEADER(CHUNK_SKIN);
+		} else if (hasSkin) {
 			SKIP_HEADER();
 			bytesWritten += writeUInt8(boneCount, rw);
 			bytesWritten += writeUInt8(specialIndexCount, rw);
@@ -587,6 +703,38 @@ uint32 Geometry::writeMeshExtension(ostream &rw)
 	return bytesWritten;
 }
 
+uint32 Geometry::writeNativeSkinMatrices(ostream &rw)
+{
+	HeaderInfo header;
+	header.build = version;
+	uint32 writtenBytesReturn;
+
+	SKIP_HEADER();
+
+	bytesWritten += writeUInt32(nativePlatform, rw);
+	bytesWritten += writeUInt8(boneCount, rw);
+	bytesWritten += writeUInt8(specialIndexCount, rw);
+	bytesWritten += writeUInt8(unknown1, rw);
+	bytesWritten += writeUInt8(unknown2, rw);
+
+	rw.write((char *) (&specialIndices[0]),
+		 specialIndexCount*sizeof(uint8));
+	bytesWritten += specialIndexCount*sizeof(uint8);
+
+	rw.write((char *) (&inverseMatrices[0]),
+		 boneCount*16*sizeof(float32));
+	bytesWritten += boneCount*16*sizeof(float32);
+
+	// unknowns
+	if (specialIndexCount != 0)
+		for (uint32 i = 0; i < 7; i++)
+			bytesWritten += writeUInt32(0, rw);
+
+	WRITE_HEADER(CHUNK_STRUCT);
+
+	return writtenBytesReturn;
+}
+
 /*
  * Material
  */
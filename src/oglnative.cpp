@@ -1,65 +1,198 @@
 #include <renderware.h>
 
 #include <cstring>
+#include <cmath>
+
+#ifdef __SSE2__
+  #include <emmintrin.h>
+#endif
 
 using namespace std;
 
 namespace rw {
 
-static void
-convertattrib(float *dst, char *data, int type, int normalized, int n)
-{
-	unsigned char *uc;
-	short *sh;
-	unsigned short *ush;
-	enum {
-		FLOAT = 0,
-		BYTE,
-		UBYTE,
-		SHORT,
-		USHORT
-	};
+enum {
+	FLOAT = 0,
+	BYTE,
+	UBYTE,
+	SHORT,
+	USHORT
+};
 
+enum {
+	VERTICES = 0,
+	UVS,
+	NORMALS,
+	COLORS,
+	WEIGHTS,
+	INDICES
+};
+
+static uint32
+attribsize(uint32 type)
+{
 	switch(type){
-	case FLOAT:
-		memcpy(dst, data, n*sizeof(float));
-		break;
-
-	case BYTE:
-		for(int i = 0; i < n; i++){
-			dst[i] = data[i];
-			if(normalized)
-				dst[i] /= 128.0f;
+	case FLOAT: return 4;
+	case BYTE: case UBYTE: return 1;
+	case SHORT: case USHORT: return 2;
+	}
+	return 0;
+}
+
+/* divisors of normalized attributes */
+static inline float normrange(float) { return 1.0f; }
+static inline float normrange(int8) { return 128.0f; }
+static inline float normrange(uint8) { return 255.0f; }
+static inline float normrange(int16) { return 32768.0f; }
+static inline float normrange(uint16) { return 65536.0f; }
+
+#ifdef __SSE2__
+/* widen 4 components to floats */
+static inline __m128
+widen(const float *v)
+{
+	return _mm_loadu_ps(v);
+}
+
+static inline __m128
+widen(const int8 *v)
+{
+	int32 w;
+	memcpy(&w, v, 4);
+	__m128i x = _mm_cvtsi32_si128(w);
+	x = _mm_unpacklo_epi8(x, x);
+	x = _mm_unpacklo_epi16(x, x);
+	return _mm_cvtepi32_ps(_mm_srai_epi32(x, 24));
+}
+
+static inline __m128
+widen(const uint8 *v)
+{
+	int32 w;
+	memcpy(&w, v, 4);
+	__m128i zero = _mm_setzero_si128();
+	__m128i x = _mm_cvtsi32_si128(w);
+	x = _mm_unpacklo_epi8(x, zero);
+	x = _mm_unpacklo_epi16(x, zero);
+	return _mm_cvtepi32_ps(x);
+}
+
+static inline __m128
+widen(const int16 *v)
+{
+	__m128i x = _mm_loadl_epi64((const __m128i *) v);
+	x = _mm_unpacklo_epi16(x, x);
+	return _mm_cvtepi32_ps(_mm_srai_epi32(x, 16));
+}
+
+static inline __m128
+widen(const uint16 *v)
+{
+	__m128i x = _mm_loadl_epi64((const __m128i *) v);
+	x = _mm_unpacklo_epi16(x, _mm_setzero_si128());
+	return _mm_cvtepi32_ps(x);
+}
+#endif
+
+/*
+ * Each converter handles one (data type, normalized, count) format and
+ * converts a whole strided stream into dn components per vertex.
+ * Components past n are 0.
+ */
+
+typedef void (*AttribConv)(void *dst, uint32 dn, const char *src,
+                           uint32 stride, uint32 count, float scale);
+
+template <typename T, bool normalized, int n>
+struct FloatAttrib
+{
+	static void
+	convert(void *dstp, uint32 dn, const char *src, uint32 stride,
+	        uint32 count, float scale)
+	{
+		float *dst = (float*) dstp;
+		float div = normalized ? normrange(T(0))*scale : scale;
+		T v[4] = { 0, 0, 0, 0 };
+		uint32 i = 0;
+#ifdef __SSE2__
+		/* 4 wide loads and stores run into the next vertex,
+		 * so leave the last one to the scalar loop */
+		if((4-n)*sizeof(T) <= stride){
+			__m128 d = _mm_set1_ps(div);
+			__m128 mask = _mm_castsi128_ps(_mm_setr_epi32(
+				-(n > 0), -(n > 1), -(n > 2), -(n > 3)));
+			for(; i+1 < count; i++, src += stride, dst += dn){
+				__m128 x = widen((const T*) src);
+				_mm_storeu_ps(dst,
+				              _mm_div_ps(_mm_and_ps(x, mask), d));
+			}
 		}
-		break;
-
-	case UBYTE:
-		uc = (unsigned char*) data;
-		for(int i = 0; i < n; i++){
-			dst[i] = uc[i];
-			if(normalized)
-				dst[i] /= 255.0f;
+#endif
+		for(; i < count; i++, src += stride, dst += dn){
+			memcpy(v, src, n*sizeof(T));
+			for(uint32 k = 0; k < dn; k++)
+				dst[k] = v[k]/div;
 		}
-		break;
-
-	case SHORT:
-		sh = (short*) data;
-		for(int i = 0; i < n; i++){
-			dst[i] = sh[i];
-			if(normalized)
-				dst[i] /= 32768.0f;
+	}
+};
+
+/* colors and bone indices stay bytes */
+template <typename T, bool normalized, int n>
+struct IntAttrib
+{
+	static void
+	convert(void *dstp, uint32 dn, const char *src, uint32 stride,
+	        uint32 count, float)
+	{
+		uint8 *dst = (uint8*) dstp;
+		if(sizeof(T) == 1 && n == 4 && dn == 4){
+			for(uint32 i = 0; i < count; i++, src += stride)
+				memcpy(&dst[i*4], src, 4);
+			return;
 		}
-		break;
-
-	case USHORT:
-		ush = (unsigned short*) data;
-		for(int i = 0; i < n; i++){
-			dst[i] = ush[i];
-			if(normalized)
-				dst[i] /= 65536.0f;
+		/* normalized shorts keep their high byte */
+		int shift = normalized && sizeof(T) == 2 ? 8 : 0;
+		T v[4] = { 0, 0, 0, 0 };
+		for(uint32 i = 0; i < count; i++, src += stride, dst += dn){
+			memcpy(v, src, n*sizeof(T));
+			for(uint32 k = 0; k < dn; k++)
+				dst[k] = (int32) v[k] >> shift;
 		}
-		break;
 	}
+};
+
+template <template <typename, bool, int> class C, typename T, bool normalized>
+static AttribConv
+findconv(uint32 n)
+{
+	switch(n){
+	case 1: return C<T, normalized, 1>::convert;
+	case 2: return C<T, normalized, 2>::convert;
+	case 3: return C<T, normalized, 3>::convert;
+	case 4: return C<T, normalized, 4>::convert;
+	}
+	return 0;
+}
+
+template <template <typename, bool, int> class C, typename T>
+static AttribConv
+findconv(uint32 normalized, uint32 n)
+{
+	return normalized ? findconv<C, T, true>(n) : findconv<C, T, false>(n);
+}
+
+template <template <typename, bool, int> class C>
+static AttribConv
+findconv(uint32 type, uint32 normalized, uint32 n)
+{
+	switch(type){
+	case FLOAT: return findconv<C, float>(normalized, n);
+	case BYTE: return findconv<C, int8>(normalized, n);
+	case UBYTE: return findconv<C, uint8>(normalized, n);
+	case SHORT: return findconv<C, int16>(normalized, n);
+	case USHORT: return findconv<C, uint16>(normalized, n);
+	}
+	return 0;
 }
 
 void
@@ -67,17 +200,7 @@ Geometry::readOglNativeData(istream &rw, int size)
 {
 	uint32 nattribs;
 	uint32 *attribs, *ap;
-	char *data, *vdata, *dp;
-	float f[4];
-
-	enum {
-		VERTICES = 0,
-		UVS,
-		NORMALS,
-		COLORS,
-		WEIGHTS,
-		INDICES
-	};
+	char *data, *vdata;
 
 	/*
 	 * attrib data contains the following for each attribute:
@@ -94,73 +217,71 @@ Geometry::readOglNativeData(istream &rw, int size)
 	rw.read(data, size-sizeof(uint32));
 	attribs = (uint32*)data;
 	vdata = data + nattribs*6*sizeof(uint32);
+	uint64 vsize = size-sizeof(uint32);
+	if((uint64)nattribs*6*sizeof(uint32) > vsize){
+		cerr << filename << ": too many attributes\n";
+		nattribs = 0;
+	}
+	vsize -= nattribs*6*sizeof(uint32);
+
+	if(vertexCount == 0)
+		nattribs = 0;
 
 	ap = attribs;
 	for(uint32 i = 0; i < nattribs; i++, ap += 6){
-		dp = vdata + ap[5];
+		void *dst;
+		uint32 dn = 4;
+		float scale = 1.0f;
+		bool integer = false;
 		switch(ap[0]){
 		case VERTICES:
-			for(uint32 j = 0; j < vertexCount; j++){
-				convertattrib(f, dp, ap[1], ap[2], ap[3]);
-				vertices.push_back(f[0]);
-				vertices.push_back(f[1]);
-				vertices.push_back(f[2]);
-				dp += ap[4];
-			}
+			vertices.resize(vertexCount*3);
+			dst = &vertices[0];
+			dn = 3;
 			break;
-
 		case UVS:
-			for(uint32 j = 0; j < vertexCount; j++){
-				convertattrib(f, dp, ap[1], ap[2], ap[3]);
-				texCoords[0].push_back(f[0]/512.0f);
-				texCoords[0].push_back(f[1]/512.0f);
-				dp += ap[4];
-			}
+			texCoords[0].resize(vertexCount*2);
+			dst = &texCoords[0][0];
+			dn = 2;
+			scale = 512.0f;
 			break;
-
 		case NORMALS:
-			for(uint32 j = 0; j < vertexCount; j++){
-				convertattrib(f, dp, ap[1], ap[2], ap[3]);
-				normals.push_back(f[0]);
-				normals.push_back(f[1]);
-				normals.push_back(f[2]);
-				dp += ap[4];
-			}
+			normals.resize(vertexCount*3);
+			dst = &normals[0];
+			dn = 3;
 			break;
-
 		case COLORS:
-			for(uint32 j = 0; j < vertexCount; j++){
-				convertattrib(f, dp, ap[1], ap[2], ap[3]);
-				vertexColors.push_back(f[0]);
-				vertexColors.push_back(f[1]);
-				vertexColors.push_back(f[2]);
-				vertexColors.push_back(f[3]);
-				dp += ap[4];
-			}
+			vertexColors.resize(vertexCount*4);
+			dst = &vertexColors[0];
+			integer = true;
 			break;
-
 		case WEIGHTS:
-			for(uint32 j = 0; j < vertexCount; j++){
-				convertattrib(f, dp, ap[1], ap[2], ap[3]);
-				vertexBoneWeights.push_back(f[0]);
-				vertexBoneWeights.push_back(f[1]);
-				vertexBoneWeights.push_back(f[2]);
-				vertexBoneWeights.push_back(f[3]);
-				dp += ap[4];
-			}
+			vertexBoneWeights.resize(vertexCount*4);
+			dst = &vertexBoneWeights[0];
 			break;
-
 		case INDICES:
-			for(uint32 j = 0; j < vertexCount; j++){
-				convertattrib(f, dp, ap[1], ap[2], ap[3]);
-				uint32 idx = ((int)f[3] << 24) |
-				             ((int)f[2] << 16) |
-				             ((int)f[1] << 8) | (int)f[0];
-				vertexBoneIndices.push_back(idx);
-				dp += ap[4];
-			}
+			vertexBoneIndices.resize(vertexCount);
+			dst = &vertexBoneIndices[0];
+			integer = true;
 			break;
+		default:
+			continue;
 		}
+
+		AttribConv conv = integer ?
+			findconv<IntAttrib>(ap[1], ap[2], ap[3]) :
+			findconv<FloatAttrib>(ap[1], ap[2], ap[3]);
+		if(conv == 0){
+			cerr << filename << ": unknown attribute format " <<
+			        ap[1] << " " << ap[3] << endl;
+			continue;
+		}
+		if(ap[5] + (uint64)(vertexCount-1)*ap[4] +
+		   attribsize(ap[1])*ap[3] > vsize){
+			cerr << filename << ": attribute data too short\n";
+			continue;
+		}
+		conv(dst, dn, vdata + ap[5], ap[4], vertexCount, scale);
 	}
 	delete[] attribs;
 
@@ -206,4 +327,190 @@ Geometry::readOglNativeData(istream &rw, int size)
 */
 }
 
+
+/*
+ * The writer interleaves the attributes, each aligned to its data type,
+ * with the stride rounded up to 4 bytes.
+ */
+
+struct OglAttrib
+{
+	uint32 index;
+	uint32 type;
+	uint32 normalized;
+	uint32 count;
+	uint32 offset;
+};
+
+static void
+addattrib(vector<OglAttrib> &attribs, uint32 &stride, uint32 index,
+          uint32 type, uint32 normalized, uint32 count)
+{
+	uint32 size = attribsize(type);
+	OglAttrib a;
+	a.index = index;
+	a.type = type;
+	a.normalized = normalized;
+	a.count = count;
+	a.offset = (stride + size-1) & ~(size-1);
+	stride = a.offset + size*count;
+	attribs.push_back(a);
+}
+
+/* rounds src*scale to T, clamped to [min, max] */
+template <typename T>
+static void
+quantize(char *dst, uint32 stride, const float32 *src, uint32 n,
+         uint32 count, float scale, float min, float max)
+{
+	T v[4];
+	for(uint32 i = 0; i < count; i++, dst += stride, src += n){
+		for(uint32 k = 0; k < n; k++){
+			float f = floor(src[k]*scale + 0.5f);
+			v[k] = f < min ? min : f > max ? max : f;
+		}
+		memcpy(dst, v, n*sizeof(T));
+	}
+}
+
+static void
+scalefloats(char *dst, uint32 stride, const float32 *src, uint32 n,
+            uint32 count, float scale)
+{
+	float32 v[4];
+	for(uint32 i = 0; i < count; i++, dst += stride, src += n){
+		for(uint32 k = 0; k < n; k++)
+			v[k] = src[k]*scale;
+		memcpy(dst, v, n*sizeof(float32));
+	}
+}
+
+static void
+copybytes(char *dst, uint32 stride, const void *src, uint32 count)
+{
+	const char *s = (const char*) src;
+	for(uint32 i = 0; i < count; i++, dst += stride)
+		memcpy(dst, &s[i*4], 4);
+}
+
+static bool
+fitsshort(const vector<float32> &v, float scale)
+{
+	for(uint32 i = 0; i < v.size(); i++){
+		float f = floor(v[i]*scale + 0.5f);
+		if(f < -32768.0f || f > 32767.0f)
+			return false;
+	}
+	return true;
+}
+
+uint32
+Geometry::writeOglNativeData(ostream &rw)
+{
+	uint32 vertexCount = vertices.size()/3;
+	bool textured = (flags & (FLAGS_TEXTURED | FLAGS_TEXTURED2)) &&
+	                texCoords[0].size() >= vertexCount*2;
+
+	/* the reader divides uvs by 512 in any case */
+	uint32 uvType = FLOAT;
+	if(textured && (oglEncoding & OGL_SHORTUVS) &&
+	   fitsshort(texCoords[0], 512.0f))
+		uvType = SHORT;
+	uint32 normalType = FLOAT;
+	if(oglEncoding & OGL_BYTENORMALS)
+		normalType = BYTE;
+	else if(oglEncoding & OGL_SHORTNORMALS)
+		normalType = SHORT;
+	uint32 weightType = oglEncoding & OGL_BYTEWEIGHTS ? UBYTE : FLOAT;
+
+	vector<OglAttrib> attribs;
+	uint32 stride = 0;
+	addattrib(attribs, stride, VERTICES, FLOAT, 0, 3);
+	if(textured)
+		addattrib(attribs, stride, UVS, uvType, 0, 2);
+	if(flags & FLAGS_NORMALS)
+		addattrib(attribs, stride, NORMALS, normalType,
+		          normalType != FLOAT, 3);
+	if(flags & FLAGS_PRELIT)
+		addattrib(attribs, stride, COLORS, UBYTE, 1, 4);
+	if(hasSkin){
+		addattrib(attribs, stride, WEIGHTS, weightType,
+		          weightType != FLOAT, 4);
+		addattrib(attribs, stride, INDICES, UBYTE, 0, 4);
+	}
+	stride = (stride + 3) & ~3;
+
+	vector<char> data(stride*vertexCount, 0);
+	for(uint32 i = 0; i < attribs.size() && vertexCount > 0; i++){
+		OglAttrib &a = attribs[i];
+		char *dst = &data[a.offset];
+		switch(a.index){
+		case VERTICES:
+			scalefloats(dst, stride, &vertices[0], 3,
+			            vertexCount, 1.0f);
+			break;
+		case UVS:
+			if(a.type == SHORT)
+				quantize<int16>(dst, stride, &texCoords[0][0],
+				                2, vertexCount, 512.0f,
+				                -32768.0f, 32767.0f);
+			else
+				scalefloats(dst, stride, &texCoords[0][0], 2,
+				            vertexCount, 512.0f);
+			break;
+		case NORMALS:
+			if(a.type == BYTE)
+				quantize<int8>(dst, stride, &normals[0], 3,
+				               vertexCount, 128.0f,
+				               -128.0f, 127.0f);
+			else if(a.type == SHORT)
+				quantize<int16>(dst, stride, &normals[0], 3,
+				                vertexCount, 32768.0f,
+				                -32768.0f, 32767.0f);
+			else
+				scalefloats(dst, stride, &normals[0], 3,
+				            vertexCount, 1.0f);
+			break;
+		case COLORS:
+			copybytes(dst, stride, &vertexColors[0], vertexCount);
+			break;
+		case WEIGHTS:
+			if(a.type == UBYTE)
+				quantize<uint8>(dst, stride,
+				                &vertexBoneWeights[0], 4,
+				                vertexCount, 255.0f,
+				                0.0f, 255.0f);
+			else
+				scalefloats(dst, stride, &vertexBoneWeights[0],
+				            4, vertexCount, 1.0f);
+			break;
+		case INDICES:
+			copybytes(dst, stride, &vertexBoneIndices[0],
+			          vertexCount);
+			break;
+		}
+	}
+
+	HeaderInfo header;
+	header.build = version;
+	header.type = CHUNK_NATIVEDATA;
+	header.length = 4 + attribs.size()*6*sizeof(uint32) + data.size();
+	uint32 bytesWritten = header.write(rw);
+
+	bytesWritten += writeUInt32(attribs.size(), rw);
+	for(uint32 i = 0; i < attribs.size(); i++){
+		bytesWritten += writeUInt32(attribs[i].index, rw);
+		bytesWritten += writeUInt32(attribs[i].type, rw);
+		bytesWritten += writeUInt32(attribs[i].normalized, rw);
+		bytesWritten += writeUInt32(attribs[i].count, rw);
+		bytesWritten += writeUInt32(stride, rw);
+		bytesWritten += writeUInt32(attribs[i].offset, rw);
+	}
+	if(data.size() > 0)
+		rw.write(&data[0], data.size());
+	bytesWritten += data.size();
+
+	return bytesWritten;
+}
+
 }
@@ -1,6 +1,13 @@
 #include <cstdio>
+#include <cstring>
+#include <cmath>
 
 #include <renderware.h>
+
+#ifdef __SSE2__
+  #include <emmintrin.h>
+#endif
+
 using namespace std;
 
 namespace rw {
@@ -10,355 +17,979 @@ namespace rw {
 #define	VERTSCALE2 (1.0/1024.0)	/* used by objects with normals */
 #define	UVSCALE (1.0/4096.0)
 
-static uint32 index;
+/*
+ * The native data is read into memory in one go. A first pass walks
+ * the DMA chain of every split and records what has to happen to the
+ * vertex arrays: unpacks, the overlap between strip batches and the
+ * end of a split. Replaying that list without data gives the array
+ * sizes, a second replay decodes straight into the arrays.
+ * All state lives in a Ps2Decoder so geometries can be decoded
+ * concurrently.
+ */
+
+enum {
+	PS2_UNPACK,
+	PS2_OVERLAP,	// drop the last two elements of an unpack type
+	PS2_SPLITEND
+};
 
-void Geometry::readPs2NativeData(istream &rw)
+struct Ps2Op
 {
-	HeaderInfo header;
+	uint32 op;
+	uint32 type;	// UNPACK code without NUM
+	uint32 count;
+	const uint8 *data;
+	uint32 split;
+};
 
-	READ_HEADER(CHUNK_STRUCT); /* wrong size */
+/* the arrays the unpacks end up in, positions are counted in vertices */
+enum {
+	ATTR_VERTEX,
+	ATTR_NORMAL,
+	ATTR_COLOR,
+	ATTR_NIGHT,
+	ATTR_WEIGHT,
+	ATTR_BONE,
+	ATTR_UV,
+	NUM_ATTRS = ATTR_UV+8
+};
 
-	if (readUInt32(rw) != PLATFORM_PS2) {
-		cerr << "error: native data not in ps2 format\n";
-		return;
+/* bytes per element of a VIF UNPACK */
+static uint32 unpackSize(uint32 type)
+{
+	uint32 vn = (type >> 26) & 3;
+	uint32 vl = (type >> 24) & 3;
+	if (vl == 3)		// V4-5
+		return 2;
+	return (vn+1) * (4 >> vl);
+}
+
+struct Ps2Decoder
+{
+	Geometry *geo;
+	vector<Ps2Op> ops;
+	vector<uint32> typesRead;	// unpacked since the last ITOP
+	bool hasNight;
+	bool hasWeights;
+
+	/* replay state, without decode only the positions move,
+	 * which gives the largest size of every array */
+	bool decode;
+	uint32 index;			// running vertex index
+	uint32 pos[NUM_ATTRS];
+	uint32 max[NUM_ATTRS];
+	uint32 numIndices;		// counted by unpack without decode
+
+	Ps2Decoder(Geometry *g) : geo(g), hasNight(false), hasWeights(false),
+	                          decode(false), index(0) {}
+	void addUnpack(uint32 type, uint32 count, const uint8 *block,
+	               uint32 size, uint32 offset, uint32 split);
+	void walkSplit(const uint8 *block, uint32 size, uint32 split,
+	               uint32 numIndices);
+	void replay(void);
+
+	void setPos(uint32 attr, uint32 newPos);
+	void skip(uint32 attr, uint32 n);
+	void pad(uint32 attr, uint32 n) { setPos(attr, pos[attr] + n); }
+	void drop(uint32 attr, uint32 n) {
+		setPos(attr, pos[attr] > n ? pos[attr] - n : 0);
 	}
+	void unpack(const Ps2Op &op);
+	void overlap(const Ps2Op &op);
+	void endSplit(void);
+};
 
-	index = 0;
-	vector<uint32> typesRead;
-	numIndices = 0;
-	for (uint32 i = 0; i < splits.size(); i++) {
-		uint32 splitSize = readUInt32(rw);
-		rw.seekg(4, ios::cur);	// bool: hasNoSectionAData
-
-		uint32 numIndices = splits[i].indices.size();
-		splits[i].indices.clear();
-		uint32 end = splitSize + rw.tellg();
-
-		uint8 chunk8[16];
-		uint32 *chunk32 = (uint32 *) chunk8;
-
-		uint32 blockStart = rw.tellg();
-		bool reachedEnd;
-		bool sectionALast = false;
-		bool sectionBLast = false;
-		bool dataAread = false;
-		while (rw.tellg() < end) {
-			/* sectionA */
-			reachedEnd = false;
-			while (!reachedEnd && !sectionALast) {
-				rw.read((char *) chunk8, 0x10);
-				switch (chunk8[3]) {
-				case 0x30: {
-					/* read all split data when we find the
-					 * first data block and ignore all
-					 * other blocks */
-					if (dataAread) {
-						/* skip dummy data */
-						rw.seekg(0x10, ios::cur);
-						break;
-					}
-					uint32 oldPos = rw.tellg();
-					uint32 dataPos = blockStart +
-					                   chunk32[1]*0x10;
-					rw.seekg(dataPos, ios::beg);
-					readData(numIndices,chunk32[3], i, rw);
-					rw.seekg(oldPos + 0x10, ios::beg);
-					break;
-				}
-				case 0x60:
-					sectionALast = true;
-					/* fall through */
-				case 0x10:
-					reachedEnd = true;
-					dataAread = true;
-					break;
-				default:
+void Ps2Decoder::addUnpack(uint32 type, uint32 count, const uint8 *block,
+                           uint32 size, uint32 offset, uint32 split)
+{
+	Ps2Op op;
+	op.op = PS2_UNPACK;
+	op.type = type & 0xFF00FFFF;
+	op.count = count;
+	op.split = split;
+	if (op.type == 0x6D00C002)
+		hasNight = true;
+	if ((op.type & 0xFFFFFF00) == 0x6C008000)
+		hasWeights = true;
+	uint32 elemSize = unpackSize(type);
+	if (offset > size || count*elemSize > size - offset) {
+		cerr << filename << ": unpack past the end of split " <<
+		        split << endl;
+		op.count = offset > size ? 0 : (size - offset)/elemSize;
+	}
+	op.data = &block[offset];
+	ops.push_back(op);
+}
+
+/* collects the operations for the DMA chain of one split */
+void Ps2Decoder::walkSplit(const uint8 *block, uint32 size, uint32 split,
+                           uint32 numIndices)
+{
+	bool strip = geo->faceType == FACETYPE_STRIP;
+	uint32 pos = 0;
+	bool sectionALast = false;
+	bool sectionBLast = false;
+	bool dataAread = false;
+	while (pos < size) {
+		/* sectionA */
+		bool reachedEnd = false;
+		while (!reachedEnd && !sectionALast) {
+			if (pos + 0x10 > size)
+				return;
+			const uint8 *chunk8 = &block[pos];
+			uint32 chunk32[4];
+			memcpy(chunk32, chunk8, 0x10);
+			pos += 0x10;
+			switch (chunk8[3]) {
+			case 0x30:
+				/* the first data block references all of the
+				 * split's data, ignore the other blocks */
+				if (dataAread) {
+					/* skip dummy data */
+					pos += 0x10;
 					break;
 				}
+				addUnpack(chunk32[3], numIndices,
+				          block, size, chunk32[1]*0x10, split);
+				pos += 0x10;
+				break;
+			case 0x60:
+				sectionALast = true;
+				/* fall through */
+			case 0x10:
+				reachedEnd = true;
+				dataAread = true;
+				break;
+			default:
+				break;
 			}
+		}
 
-			/* sectionB */
-			reachedEnd = false;
-			while (!reachedEnd && !sectionBLast) {
-				rw.read((char *) chunk8, 0x10);
-				switch (chunk8[3]) {
-				case 0x00:
-				case 0x07:
-					readData(chunk8[14],chunk32[3], i, rw);
-					/* remember what sort of data we read */
-					typesRead.push_back(chunk32[3]);
-					break;
-				case 0x04:
-					if (chunk8[7] == 0x15)
-						;//first
-					else if (chunk8[7] == 0x17)
-						;//not first
-
-					if ((chunk8[11] == 0x11 &&
-					      chunk8[15] == 0x11) ||
-					    (chunk8[11] == 0x11 &&
-					      chunk8[15] == 0x06)) {
-						// last
-						rw.seekg(end, ios::beg);
-						typesRead.clear();
-						sectionBLast = true;
-					} else if (chunk8[11] == 0 &&
-					           chunk8[15] == 0 &&
-					           faceType == FACETYPE_STRIP) {
-						deleteOverlapping(typesRead, i);
-						typesRead.clear();
-						// not last
+		/* sectionB */
+		reachedEnd = false;
+		while (!reachedEnd && !sectionBLast) {
+			if (pos + 0x10 > size)
+				return;
+			const uint8 *chunk8 = &block[pos];
+			uint32 chunk32[4];
+			memcpy(chunk32, chunk8, 0x10);
+			pos += 0x10;
+			switch (chunk8[3]) {
+			case 0x00:
+			case 0x07: {
+				uint32 count = chunk8[14];
+				addUnpack(chunk32[3], count,
+				          block, size, pos, split);
+				/* remember what sort of data we read */
+				typesRead.push_back(chunk32[3] & 0xFF00FFFF);
+				/* data is padded to qwords */
+				pos += (count*unpackSize(chunk32[3]) + 0xF) & ~0xF;
+				break;
+			}
+			case 0x04:
+				if ((chunk8[11] == 0x11 && chunk8[15] == 0x11) ||
+				    (chunk8[11] == 0x11 && chunk8[15] == 0x06)) {
+					// last
+					pos = size;
+					typesRead.clear();
+					sectionBLast = true;
+				} else if (chunk8[11] == 0 && chunk8[15] == 0 &&
+				           strip) {
+					// not last, the next batch repeats
+					// two vertices
+					Ps2Op op;
+					op.op = PS2_OVERLAP;
+					op.count = 2;
+					op.data = 0;
+					op.split = split;
+					for (uint32 i = 0; i < typesRead.size(); i++) {
+						op.type = typesRead[i];
+						ops.push_back(op);
 					}
-					reachedEnd = true;
-					break;
-				default:
-					break;
+					typesRead.clear();
 				}
+				reachedEnd = true;
+				break;
+			default:
+				break;
 			}
 		}
-		this->numIndices += splits[i].indices.size();
-
-		// TODO: night vertex colors
-		int nverts = vertices.size()/3;
-		if(flags & FLAGS_NORMALS)
-			normals.resize(nverts*3);
-		if(flags & FLAGS_PRELIT){
-			vertexColors.resize(nverts*4);
-			nightColors.resize(nverts*4);
-		}
-		if(flags & FLAGS_TEXTURED || flags & FLAGS_TEXTURED2)
-			for(uint32 i = 0; i < numUVs; i++)
-				texCoords[i].resize(nverts*2);
 	}
+}
 
 /*
-	int nverts = vertices.size()/3;
-	// this happens in some objects
-	if(flags & FLAGS_NORMALS && normals.size() == 0)
-		normals.resize(vertices.size());
-	// never seen this but be careful
-	if(flags & FLAGS_PRELIT && vertexColors.size() == 0)
-		vertexColors.resize(nverts*4);
-	// this also happens
-	if(flags & FLAGS_TEXTURED || flags & FLAGS_TEXTURED2)
-		for(uint32 i = 0; i < numUVs; i++)
-			if(texCoords[i].size() == 0)
-				texCoords[i].resize(nverts*2);
-*/
+ * Unpack kernels, the integer formats are widened and scaled
+ */
+
+/* takes dstComps int16 components starting at first out of every
+ * srcComps and converts them to float */
+static void unpackInt16(float32 *dst, const uint8 *src, uint32 n,
+                        uint32 srcComps, uint32 first, uint32 dstComps,
+                        float32 scale)
+{
+	const int16 *s = (const int16 *) src;
+	uint32 i = 0;
+#ifdef __SSE2__
+	__m128 vscale = _mm_set1_ps(scale);
+	if (srcComps == 4) {
+		for (; i < n; i++) {
+			__m128i x = _mm_loadl_epi64((const __m128i *) &s[i*4]);
+			x = _mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16);
+			__m128 f = _mm_mul_ps(_mm_cvtepi32_ps(x), vscale);
+			if (first == 2)
+				f = _mm_movehl_ps(f, f);
+			_mm_storel_pi((__m64 *) &dst[i*dstComps], f);
+			if (dstComps == 3)
+				_mm_store_ss(&dst[i*3+2], _mm_movehl_ps(f, f));
+		}
+	} else if (srcComps == 2 && dstComps == 2) {
+		// two elements at a time
+		for (; i+2 <= n; i += 2) {
+			__m128i x = _mm_loadl_epi64((const __m128i *) &s[i*2]);
+			x = _mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16);
+			_mm_storeu_ps(&dst[i*2],
+			              _mm_mul_ps(_mm_cvtepi32_ps(x), vscale));
+		}
+	}
+#endif
+	for (; i < n; i++)
+		for (uint32 c = 0; c < dstComps; c++)
+			dst[i*dstComps+c] = s[i*srcComps+first+c] * scale;
 }
 
+/* three int8 components out of every srcComps to float */
+static void unpackInt8(float32 *dst, const uint8 *src, uint32 n,
+                       uint32 srcComps, float32 scale)
+{
+	const int8 *s = (const int8 *) src;
+	uint32 i = 0;
+#ifdef __SSE2__
+	if (srcComps == 4) {
+		__m128 vscale = _mm_set1_ps(scale);
+		for (; i < n; i++) {
+			int32 v;
+			memcpy(&v, &s[i*4], 4);
+			__m128i x = _mm_cvtsi32_si128(v);
+			x = _mm_unpacklo_epi8(x, x);
+			x = _mm_srai_epi32(_mm_unpacklo_epi16(x, x), 24);
+			__m128 f = _mm_mul_ps(_mm_cvtepi32_ps(x), vscale);
+			_mm_storel_pi((__m64 *) &dst[i*3], f);
+			_mm_store_ss(&dst[i*3+2], _mm_movehl_ps(f, f));
+		}
+	}
+#endif
+	for (; i < n; i++)
+		for (uint32 c = 0; c < 3; c++)
+			dst[i*3+c] = s[i*srcComps+c] * scale;
+}
 
-void Geometry::readData(uint32 vertexCount, uint32 type,
-                        uint32 split, istream &rw)
+/* day and night colors come interleaved byte by byte */
+static void unpackDayNight(uint8 *day, uint8 *night, const uint8 *src,
+                           uint32 n)
 {
-	float32 vertexScale = (flags & FLAGS_PRELIT) ? VERTSCALE1 : VERTSCALE2;
+	uint32 i = 0;
+#ifdef __SSE2__
+	__m128i low = _mm_set1_epi16(0xFF);
+	for (; i+4 <= n; i += 4) {
+		__m128i a = _mm_loadu_si128((const __m128i *) &src[i*8]);
+		__m128i b = _mm_loadu_si128((const __m128i *) &src[i*8+16]);
+		_mm_storeu_si128((__m128i *) &day[i*4],
+		                 _mm_packus_epi16(_mm_and_si128(a, low),
+		                                  _mm_and_si128(b, low)));
+		_mm_storeu_si128((__m128i *) &night[i*4],
+		                 _mm_packus_epi16(_mm_srli_epi16(a, 8),
+		                                  _mm_srli_epi16(b, 8)));
+	}
+#endif
+	for (uint32 j = i*4; j < n*4; j++) {
+		day[j] = src[j*2];
+		night[j] = src[j*2+1];
+	}
+}
 
-	uint32 size = 0;
-	type &= 0xFF00FFFF;
-	/* TODO: read greater chunks */
-	switch (type) {
-	/* Vertices */
-	case 0x68008000: {
-		size = 3 * sizeof(float32);
-		for (uint32 j = 0; j < vertexCount; j++) {
-			vertices.push_back(readFloat32(rw));
-			vertices.push_back(readFloat32(rw));
-			vertices.push_back(readFloat32(rw));
-			splits[split].indices.push_back(index++);
+/* the weights carry the bone index + 1 in their low mantissa bits,
+ * both come out in one go */
+static void unpackSkin(float32 *weights, uint32 *bones, const uint8 *src,
+                       uint32 n)
+{
+	uint32 i = 0;
+#ifdef __SSE2__
+	__m128i mask = _mm_set1_epi32(0xFF);
+	__m128i one = _mm_set1_epi32(1);
+	__m128i zero = _mm_setzero_si128();
+	for (; i+4 <= n; i += 4) {
+		__m128i idx[4];
+		for (uint32 k = 0; k < 4; k++) {
+			__m128i w = _mm_loadu_si128(
+				(const __m128i *) &src[(i+k)*16]);
+			_mm_storeu_si128((__m128i *) &weights[(i+k)*4], w);
+			__m128i b = _mm_and_si128(_mm_srli_epi32(w, 2), mask);
+			// 0 stays 0
+			idx[k] = _mm_sub_epi32(_mm_sub_epi32(b, one),
+			                       _mm_cmpeq_epi32(b, zero));
+		}
+		_mm_storeu_si128((__m128i *) &bones[i],
+		                 _mm_packus_epi16(
+		                   _mm_packs_epi32(idx[0], idx[1]),
+		                   _mm_packs_epi32(idx[2], idx[3])));
+	}
+#endif
+	for (; i < n; i++) {
+		uint32 w[4];
+		memcpy(w, &src[i*16], 16);
+		memcpy(&weights[i*4], w, 16);
+		uint8 indices[4];
+		for (uint32 j = 0; j < 4; j++) {
+			indices[j] = w[j] >> 2;
+			if (indices[j] != 0)
+				indices[j] -= 1;
+		}
+		bones[i] = indices[3] << 24 | indices[2] << 16 |
+		           indices[1] << 8 | indices[0];
+	}
+}
+
+
+void Ps2Decoder::setPos(uint32 attr, uint32 newPos)
+{
+	// positions that are skipped over are zero
+	if (decode && newPos > pos[attr]) {
+		uint32 n = newPos - pos[attr];
+		switch (attr) {
+		case ATTR_VERTEX:
+			memset(&geo->vertices[pos[attr]*3], 0, n*3*4);
+			break;
+		case ATTR_NORMAL:
+			memset(&geo->normals[pos[attr]*3], 0, n*3*4);
+			break;
+		case ATTR_COLOR:
+			memset(&geo->vertexColors[pos[attr]*4], 0, n*4);
+			break;
+		case ATTR_NIGHT:
+			memset(&geo->nightColors[pos[attr]*4], 0, n*4);
+			break;
+		case ATTR_WEIGHT:
+			memset(&geo->vertexBoneWeights[pos[attr]*4], 0, n*4*4);
+			break;
+		case ATTR_BONE:
+			memset(&geo->vertexBoneIndices[pos[attr]], 0, n*4);
+			break;
+		default:
+			memset(&geo->texCoords[attr-ATTR_UV][pos[attr]*2], 0,
+			       n*2*4);
+			break;
 		}
+	}
+	pos[attr] = newPos;
+	if (newPos > max[attr])
+		max[attr] = newPos;
+}
+
+/* moves past what was just decoded */
+void Ps2Decoder::skip(uint32 attr, uint32 n)
+{
+	pos[attr] += n;
+	if (pos[attr] > max[attr])
+		max[attr] = pos[attr];
+}
+
+void Ps2Decoder::unpack(const Ps2Op &op)
+{
+	Geometry &g = *geo;
+	float32 vertexScale = (g.flags & FLAGS_PRELIT) ? VERTSCALE1 : VERTSCALE2;
+	vector<uint32> &indices = g.splits[op.split].indices;
+	uint32 n = op.count;
+	const uint8 *data = op.data;
+
+	switch (op.type) {
+	/* Vertices */
+	case 0x68008000:
+		if (decode) {
+			memcpy(&g.vertices[pos[ATTR_VERTEX]*3], data, n*12);
+			for (uint32 j = 0; j < n; j++)
+				indices.push_back(index++);
+		} else
+			numIndices += n;
+		skip(ATTR_VERTEX, n);
 		break;
-	} case 0x6D008000: {
-		size = 4 * sizeof(int16);
-		int16 vertex[4];
-		for (uint32 j = 0; j < vertexCount; j++) {
-			rw.read((char *) (vertex), size);
-			uint32 flag = vertex[3] & 0xFFFF;
-			vertices.push_back(vertex[0] * vertexScale);
-			vertices.push_back(vertex[1] * vertexScale);
-			vertices.push_back(vertex[2] * vertexScale);
-			if (flag == 0x8000){
-				splits[split].indices.push_back(index-1);
-				splits[split].indices.push_back(index-1);
+	case 0x6D008000:
+		if (decode) {
+			unpackInt16(&g.vertices[pos[ATTR_VERTEX]*3], data, n,
+			            4, 0, 3, vertexScale);
+			for (uint32 j = 0; j < n; j++) {
+				// ADC bit: restart the strip here
+				if ((data[j*8+7] << 8 | data[j*8+6]) == 0x8000) {
+					indices.push_back(index-1);
+					indices.push_back(index-1);
+				}
+				indices.push_back(index++);
 			}
-			splits[split].indices.push_back(index++);
+		} else {
+			numIndices += n;
+			for (uint32 j = 0; j < n; j++)
+				if ((data[j*8+7] << 8 | data[j*8+6]) == 0x8000)
+					numIndices += 2;
 		}
+		skip(ATTR_VERTEX, n);
 		break;
 	/* Texture coordinates */
-	} case 0x64008001: {
-		size = 2 * sizeof(float32);
-		for (uint32 j = 0; j < vertexCount; j++) {
-			texCoords[0].push_back(readFloat32(rw));
-			texCoords[0].push_back(readFloat32(rw));
-		}
-		for (uint32 i = 1; i < numUVs; i++) {
-			for (uint32 j = 0; j < vertexCount; j++) {
-				texCoords[i].push_back(0);
-				texCoords[i].push_back(0);
-			}
-		}
+	case 0x64008001:
+		if (decode)
+			memcpy(&g.texCoords[0][pos[ATTR_UV]*2], data, n*8);
+		skip(ATTR_UV, n);
+		for (uint32 i = 1; i < g.numUVs; i++)
+			pad(ATTR_UV+i, n);
 		break;
-	} case 0x6D008001: {
-		size = 2 * sizeof(int16);
-		int16 texCoord[2];
-		for (uint32 j = 0; j < vertexCount; j++) {
-			for (uint32 i = 0; i < numUVs; i++) {
-				rw.read((char *) (texCoord), size);
-				texCoords[i].push_back(texCoord[0] * UVSCALE);
-				texCoords[i].push_back(texCoord[1] * UVSCALE);
+	case 0x6D008001:
+		// two sets in one unpack
+		for (uint32 i = 0; i < g.numUVs; i++) {
+			if (i >= 2) {
+				pad(ATTR_UV+i, n);
+				continue;
 			}
+			if (decode)
+				unpackInt16(&g.texCoords[i][pos[ATTR_UV+i]*2],
+				            data, n, 4, i*2, 2, UVSCALE);
+			skip(ATTR_UV+i, n);
 		}
-		size *= numUVs;
 		break;
-	} case 0x65008001: {
-		size = 2 * sizeof(int16);
-		int16 texCoord[2];
-		for (uint32 j = 0; j < vertexCount; j++) {
-			rw.read((char *) (texCoord), size);
-			texCoords[0].push_back(texCoord[0] * UVSCALE);
-			texCoords[0].push_back(texCoord[1] * UVSCALE);
-		}
-		for (uint32 i = 1; i < numUVs; i++) {
-			for (uint32 j = 0; j < vertexCount; j++) {
-				texCoords[i].push_back(0);
-				texCoords[i].push_back(0);
-			}
-		}
+	case 0x65008001:
+		if (decode)
+			unpackInt16(&g.texCoords[0][pos[ATTR_UV]*2], data, n,
+			            2, 0, 2, UVSCALE);
+		skip(ATTR_UV, n);
+		for (uint32 i = 1; i < g.numUVs; i++)
+			pad(ATTR_UV+i, n);
 		break;
 	/* Vertex colors */
-	} case 0x6D00C002: {
-		size = 8 * sizeof(uint8);
-		for (uint32 j = 0; j < vertexCount; j++) {
-			vertexColors.push_back(readUInt8(rw));
-			nightColors.push_back(readUInt8(rw));
-			vertexColors.push_back(readUInt8(rw));
-			nightColors.push_back(readUInt8(rw));
-			vertexColors.push_back(readUInt8(rw));
-			nightColors.push_back(readUInt8(rw));
-			vertexColors.push_back(readUInt8(rw));
-			nightColors.push_back(readUInt8(rw));
-		}
+	case 0x6D00C002:
+		if (decode)
+			unpackDayNight(&g.vertexColors[pos[ATTR_COLOR]*4],
+			               &g.nightColors[pos[ATTR_NIGHT]*4],
+			               data, n);
+		skip(ATTR_COLOR, n);
+		skip(ATTR_NIGHT, n);
 		break;
-	} case 0x6E00C002: {
-		size = 4 * sizeof(uint8);
-		for (uint32 j = 0; j < vertexCount; j++) {
-			vertexColors.push_back(readUInt8(rw));
-			vertexColors.push_back(readUInt8(rw));
-			vertexColors.push_back(readUInt8(rw));
-			vertexColors.push_back(readUInt8(rw));
-		}
+	case 0x6E00C002:
+		if (decode)
+			memcpy(&g.vertexColors[pos[ATTR_COLOR]*4], data, n*4);
+		skip(ATTR_COLOR, n);
 		break;
 	/* Normals */
-	} case 0x6E008002: case 0x6E008003: {
-		size = 4 * sizeof(int8);
-		int8 normal[4];
-		for (uint32 j = 0; j < vertexCount; j++) {
-			rw.read((char *) (normal), size);
-			normals.push_back(normal[0] * NORMALSCALE);
-			normals.push_back(normal[1] * NORMALSCALE);
-			normals.push_back(normal[2] * NORMALSCALE);
-		}
+	case 0x6E008002: case 0x6E008003:
+		if (decode)
+			unpackInt8(&g.normals[pos[ATTR_NORMAL]*3], data, n, 4,
+			           NORMALSCALE);
+		skip(ATTR_NORMAL, n);
 		break;
-	} case 0x6A008003: {
-		size = 3 * sizeof(int8);
-		int8 normal[3];
-		for (uint32 j = 0; j < vertexCount; j++) {
-			rw.read((char *) (normal), size);
-			normals.push_back(normal[0] * NORMALSCALE);
-			normals.push_back(normal[1] * NORMALSCALE);
-			normals.push_back(normal[2] * NORMALSCALE);
-		}
+	case 0x6A008003:
+		if (decode)
+			unpackInt8(&g.normals[pos[ATTR_NORMAL]*3], data, n, 3,
+			           NORMALSCALE);
+		skip(ATTR_NORMAL, n);
 		break;
 	/* Skin weights and indices */
-	} case 0x6C008004: case 0x6C008003: case 0x6C008001: {
-		size = 4 * sizeof(float32);
-		float32 weight[4];
-		uint32 *w = (uint32 *) weight;
-		uint8 indices[4];;
-		for (uint32 j = 0; j < vertexCount; j++) {
-			rw.read((char *) (weight), size);
-			for (uint32 i = 0; i < 4; i++) {
-				vertexBoneWeights.push_back(weight[i]);
-				indices[i] = w[i] >> 2;
-				if (indices[i] != 0)
-					indices[i] -= 1;
-			}
-			vertexBoneIndices.push_back(indices[3] << 24 |
-			                            indices[2] << 16 |
-			                            indices[1] << 8 |
-			                            indices[0]);
-		}
+	case 0x6C008004: case 0x6C008003: case 0x6C008001:
+		if (decode)
+			unpackSkin(&g.vertexBoneWeights[pos[ATTR_WEIGHT]*4],
+			           &g.vertexBoneIndices[pos[ATTR_BONE]],
+			           data, n);
+		skip(ATTR_WEIGHT, n);
+		skip(ATTR_BONE, n);
+		break;
+	default:
+		if (decode)
+			cout << "unknown data type: " << hex << op.type <<
+			        " " << filename << dec << endl;
 		break;
 	}
+}
+
+void Ps2Decoder::overlap(const Ps2Op &op)
+{
+	Geometry &g = *geo;
+	switch (op.type) {
+	/* Vertices */
+	case 0x68008000:
+	case 0x6D008000:
+		drop(ATTR_VERTEX, op.count);
+		if (decode) {
+			vector<uint32> &indices = g.splits[op.split].indices;
+			indices.resize(indices.size() > op.count ?
+			               indices.size() - op.count : 0);
+		}
+		index -= op.count;
+		break;
+	/* Texture coordinates */
+	case 0x64008001:
+	case 0x65008001:
+	case 0x6D008001:
+		for (uint32 j = 0; j < g.numUVs; j++)
+			drop(ATTR_UV+j, op.count);
+		break;
+	/* Vertex colors */
+	case 0x6D00C002:
+		drop(ATTR_NIGHT, op.count);
+		/* fall through */
+	case 0x6E00C002:
+		drop(ATTR_COLOR, op.count);
+		break;
+	/* Normals */
+	case 0x6E008002:
+	case 0x6E008003:
+	case 0x6A008003:
+		drop(ATTR_NORMAL, op.count);
+		break;
+	/* Skin weights and indices*/
+	case 0x6C008004:
+	case 0x6C008003:
+	case 0x6C008001:
+		drop(ATTR_WEIGHT, op.count);
+		drop(ATTR_BONE, op.count);
+		break;
 	default:
-		cout << "unknown data type: " << hex << type;
-		cout << " " << filename << " " << hex << rw.tellg() << endl;
+		if (decode)
+			cout << "unknown data type: " << hex << op.type <<
+			        dec << endl;
 		break;
 	}
+}
 
-	/* skip padding */
-	if (vertexCount*size & 0xF)
-		rw.seekg(0x10 - (vertexCount*size & 0xF), ios::cur);
+/* arrays the flags ask for are made as long as the vertex array */
+void Ps2Decoder::endSplit(void)
+{
+	Geometry &g = *geo;
+	uint32 nverts = pos[ATTR_VERTEX];
+	if (g.flags & FLAGS_NORMALS)
+		setPos(ATTR_NORMAL, nverts);
+	if (g.flags & FLAGS_PRELIT)
+		setPos(ATTR_COLOR, nverts);
+	if (g.flags & FLAGS_TEXTURED || g.flags & FLAGS_TEXTURED2)
+		for (uint32 i = 0; i < g.numUVs; i++)
+			setPos(ATTR_UV+i, nverts);
+	/* only if some split has them */
+	if (hasNight)
+		setPos(ATTR_NIGHT, nverts);
+	if (hasWeights) {
+		setPos(ATTR_WEIGHT, nverts);
+		setPos(ATTR_BONE, nverts);
+	}
 }
 
-void Geometry::deleteOverlapping(vector<uint32> &typesRead, uint32 split)
+/* count, then size the arrays and decode */
+void Ps2Decoder::replay(void)
 {
-	uint32 size;
-	for (uint32 i = 0; i < typesRead.size(); i++) {
-		switch (typesRead[i] & 0xFF00FFFF) {
-		/* Vertices */
-		case 0x68008000:
-		case 0x6D008000:
-			size = vertices.size();
-			vertices.resize(size-2*3);
-
-			size = splits[split].indices.size();
-			splits[split].indices.resize(size-2);
-			index -= 2;
-			break;
-		/* Texture coordinates */
-		case 0x64008001:
-		case 0x65008001:
-//			size = texCoords[0].size();
-//			texCoords[0].resize(size-2*2);
-//			break;
-		case 0x6D008001:
-			for (uint32 j = 0; j < numUVs; j++) {
-				size = texCoords[j].size();
-				texCoords[j].resize(size-2*2);
+	Geometry &g = *geo;
+	uint32 start[NUM_ATTRS];
+	start[ATTR_VERTEX] = g.vertices.size()/3;
+	start[ATTR_NORMAL] = g.normals.size()/3;
+	start[ATTR_COLOR] = g.vertexColors.size()/4;
+	start[ATTR_NIGHT] = g.nightColors.size()/4;
+	start[ATTR_WEIGHT] = g.vertexBoneWeights.size()/4;
+	start[ATTR_BONE] = g.vertexBoneIndices.size();
+	for (uint32 i = 0; i < 8; i++)
+		start[ATTR_UV+i] = g.texCoords[i].size()/2;
+	vector<uint32> splitIndices(g.splits.size(), 0);
+	for (uint32 pass = 0; pass < 2; pass++) {
+		decode = pass == 1;
+		index = 0;
+		memcpy(pos, start, sizeof(start));
+		memcpy(max, start, sizeof(start));
+		for (uint32 i = 0; i < ops.size(); i++) {
+			switch (ops[i].op) {
+			case PS2_UNPACK:
+				numIndices = 0;
+				unpack(ops[i]);
+				splitIndices[ops[i].split] += numIndices;
+				break;
+			case PS2_OVERLAP:
+				overlap(ops[i]);
+				break;
+			case PS2_SPLITEND:
+				endSplit();
+				break;
 			}
+		}
+		if (pass == 0) {
+			g.vertices.resize(max[ATTR_VERTEX]*3);
+			g.normals.resize(max[ATTR_NORMAL]*3);
+			g.vertexColors.resize(max[ATTR_COLOR]*4);
+			g.nightColors.resize(max[ATTR_NIGHT]*4);
+			g.vertexBoneWeights.resize(max[ATTR_WEIGHT]*4);
+			g.vertexBoneIndices.resize(max[ATTR_BONE]);
+			for (uint32 i = 0; i < 8; i++)
+				g.texCoords[i].resize(max[ATTR_UV+i]*2);
+			for (uint32 i = 0; i < g.splits.size(); i++) {
+				g.splits[i].indices.clear();
+				g.splits[i].indices.reserve(splitIndices[i]);
+			}
+		}
+	}
+	g.vertices.resize(pos[ATTR_VERTEX]*3);
+	g.normals.resize(pos[ATTR_NORMAL]*3);
+	g.vertexColors.resize(pos[ATTR_COLOR]*4);
+	g.nightColors.resize(pos[ATTR_NIGHT]*4);
+	g.vertexBoneWeights.resize(pos[ATTR_WEIGHT]*4);
+	g.vertexBoneIndices.resize(pos[ATTR_BONE]);
+	for (uint32 i = 0; i < 8; i++)
+		g.texCoords[i].resize(pos[ATTR_UV+i]*2);
+}
+
+void Geometry::readPs2NativeData(istream &rw, int size)
+{
+	HeaderInfo header;
+	uint32 chunkStart = rw.tellg();
+
+	READ_HEADER(CHUNK_STRUCT); /* wrong size */
+
+	if (readUInt32(rw) != PLATFORM_PS2) {
+		cerr << "error: native data not in ps2 format\n";
+		return;
+	}
+
+	uint32 dataSize = size - (uint32(rw.tellg()) - chunkStart);
+	vector<uint8> data(dataSize + 0x10);
+	rw.read((char *) &data[0], dataSize);
+	dataSize = rw.gcount();
+
+	Ps2Decoder dec(this);
+	uint32 pos = 0;
+	for (uint32 i = 0; i < splits.size(); i++) {
+		uint32 splitSize = 0;
+		if (pos + 8 <= dataSize)
+			memcpy(&splitSize, &data[pos], 4);
+		pos += 8;	// bool: hasNoSectionAData
+		if (pos > dataSize)
+			pos = dataSize;
+		if (splitSize > dataSize - pos)
+			splitSize = dataSize - pos;
+
+		dec.walkSplit(&data[pos], splitSize, i,
+		              splits[i].indices.size());
+		pos += splitSize;
+
+		Ps2Op op;
+		op.op = PS2_SPLITEND;
+		op.split = i;
+		dec.ops.push_back(op);
+	}
+	dec.replay();
+
+	numIndices = 0;
+	for (uint32 i = 0; i < splits.size(); i++)
+		numIndices += splits[i].indices.size();
+}
+
+
+/*
+ * Writing
+ */
+
+#define DMA_CNT		0x10000000
+#define DMA_REF		0x30000000
+#define DMA_RET		0x60000000
+#define VIF_STCYCL	0x01000000
+#define VIF_ITOP	0x04000000
+#define VIF_FLUSH	0x11000000
+#define VIF_MSCALF	0x15000000
+#define VIF_MSCNT	0x17000000
+
+/* VU1 memory is double buffered, a batch has to fit in one half */
+#define VU_BUFFER	0x1F0
+
+struct Ps2Attrib
+{
+	uint32 type;		// UNPACK code without NUM
+	uint32 size;		// bytes per vertex
+	vector<uint8> data;	// one element per index of the split
+};
+
+static int16 quantize16(float32 f, float32 scale)
+{
+	float32 q = floor(f*scale + 0.5f);
+	return q > 32767.0f ? 32767 : q < -32768.0f ? -32768 : int16(q);
+}
+
+static int8 quantize8(float32 f, float32 scale)
+{
+	float32 q = floor(f*scale + 0.5f);
+	return q > 127.0f ? 127 : q < -128.0f ? -128 : int8(q);
+}
+
+static bool fits16(const vector<float32> &v, float32 scale)
+{
+	for (uint32 i = 0; i < v.size(); i++)
+		if (v[i]*scale >= 32767.5f || v[i]*scale < -32768.5f)
+			return false;
+	return true;
+}
+
+/* the layout of the vertex data, the same for all splits */
+struct Ps2Layout
+{
+	uint32 vertexType;
+	uint32 uvType;
+	uint32 colorType;
+	uint32 normalType;
+	uint32 skinType;
+	float32 vertexScale;
+};
+
+static void chooseLayout(Ps2Layout &l, const Geometry &g)
+{
+	/* San Andreas quantizes, the older games' pipelines
+	 * only know floats */
+	bool quantize = version == SA;
+	l.vertexScale = (g.flags & FLAGS_PRELIT) ? 1.0f/VERTSCALE1 :
+	                                           1.0f/VERTSCALE2;
+	l.vertexType = 0x68008000;
+	if (quantize && fits16(g.vertices, l.vertexScale))
+		l.vertexType = 0x6D008000;
+
+	l.uvType = 0;
+	if ((g.flags & (FLAGS_TEXTURED | FLAGS_TEXTURED2)) && g.numUVs > 0) {
+		l.uvType = 0x64008001;
+		/* two sets only exist as 16 bit integers, more not at all */
+		if (g.numUVs == 2 && quantize &&
+		    fits16(g.texCoords[0], 1.0f/UVSCALE) &&
+		    fits16(g.texCoords[1], 1.0f/UVSCALE))
+			l.uvType = 0x6D008001;
+		else if (g.numUVs == 1 && quantize &&
+		         fits16(g.texCoords[0], 1.0f/UVSCALE))
+			l.uvType = 0x65008001;
+	}
+
+	l.colorType = 0;
+	if (g.flags & FLAGS_PRELIT)
+		l.colorType = g.nightColors.size() == g.vertexColors.size() ?
+		              0x6D00C002 : 0x6E00C002;
+	l.normalType = (g.flags & FLAGS_NORMALS) ? 0x6E008003 : 0;
+	l.skinType = g.hasSkin ? 0x6C008004 : 0;
+}
+
+/* whether the layout can hold all uv sets */
+bool Geometry::ps2UVsFit(void) const
+{
+	Ps2Layout l;
+	chooseLayout(l, *this);
+	return l.uvType != 0x64008001 || numUVs <= 1;
+}
+
+/* unrolls the vertices of one split in the formats of the layout */
+static void buildAttribs(vector<Ps2Attrib> &attribs, const Geometry &g,
+                         const Ps2Layout &l, const vector<uint32> &indices)
+{
+	uint32 n = indices.size();
+	uint32 nverts = g.vertices.size()/3;
+	Ps2Attrib a;
+
+	a.type = l.vertexType;
+	a.size = l.vertexType == 0x68008000 ? 12 : 8;
+	a.data.assign((n*a.size + 0xF) & ~0xF, 0);
+	for (uint32 i = 0; i < n && nverts > 0; i++) {
+		uint32 v = indices[i] < nverts ? indices[i] : 0;
+		if (a.size == 12) {
+			memcpy(&a.data[i*12], &g.vertices[v*3], 12);
+			continue;
+		}
+		int16 q[4];
+		for (uint32 c = 0; c < 3; c++)
+			q[c] = quantize16(g.vertices[v*3+c], l.vertexScale);
+		q[3] = 0;
+		memcpy(&a.data[i*8], q, 8);
+	}
+	attribs.push_back(a);
+
+	if (l.uvType) {
+		a.type = l.uvType;
+		a.size = l.uvType == 0x65008001 ? 4 : 8;
+		a.data.assign((n*a.size + 0xF) & ~0xF, 0);
+		for (uint32 i = 0; i < n; i++) {
+			uint32 v = indices[i];
+			if (l.uvType == 0x64008001) {
+				if (v*2 < g.texCoords[0].size())
+					memcpy(&a.data[i*8],
+					       &g.texCoords[0][v*2], 8);
+				continue;
+			}
+			int16 q[4] = { 0, 0, 0, 0 };
+			uint32 sets = l.uvType == 0x6D008001 ? 2 : 1;
+			for (uint32 j = 0; j < sets; j++) {
+				const vector<float32> &uv = g.texCoords[j];
+				if (v*2 >= uv.size())
+					continue;
+				q[j*2] = quantize16(uv[v*2], 1.0f/UVSCALE);
+				q[j*2+1] = quantize16(uv[v*2+1], 1.0f/UVSCALE);
+			}
+			memcpy(&a.data[i*a.size], q, a.size);
+		}
+		attribs.push_back(a);
+	}
+
+	if (l.colorType) {
+		a.type = l.colorType;
+		a.size = l.colorType == 0x6D00C002 ? 8 : 4;
+		a.data.assign((n*a.size + 0xF) & ~0xF, 0);
+		for (uint32 i = 0; i < n; i++) {
+			uint32 v = indices[i];
+			if (v*4 >= g.vertexColors.size())
+				continue;
+			for (uint32 c = 0; c < 4; c++) {
+				if (a.size == 4) {
+					a.data[i*4+c] = g.vertexColors[v*4+c];
+					continue;
+				}
+				// day and night interleaved
+				a.data[i*8+c*2] = g.vertexColors[v*4+c];
+				a.data[i*8+c*2+1] = g.nightColors[v*4+c];
+			}
+		}
+		attribs.push_back(a);
+	}
+
+	if (l.normalType) {
+		a.type = l.normalType;
+		a.size = 4;
+		a.data.assign((n*4 + 0xF) & ~0xF, 0);
+		for (uint32 i = 0; i < n; i++) {
+			uint32 v = indices[i];
+			if (v*3 >= g.normals.size())
+				continue;
+			for (uint32 c = 0; c < 3; c++)
+				a.data[i*4+c] = quantize8(g.normals[v*3+c],
+				                          1.0f/NORMALSCALE);
+		}
+		attribs.push_back(a);
+	}
+
+	if (l.skinType) {
+		a.type = l.skinType;
+		a.size = 16;
+		a.data.assign(n*16, 0);
+		for (uint32 i = 0; i < n; i++) {
+			uint32 v = indices[i];
+			if (v >= g.vertexBoneIndices.size() ||
+			    v*4 >= g.vertexBoneWeights.size())
+				continue;
+			/* bone index + 1 goes into the low mantissa bits */
+			uint32 w[4];
+			memcpy(w, &g.vertexBoneWeights[v*4], 16);
+			for (uint32 j = 0; j < 4; j++) {
+				uint32 bone = g.vertexBoneIndices[v] >> j*8 & 0xFF;
+				w[j] = (w[j] & ~0x3FC) | ((bone+1) & 0xFF) << 2;
+			}
+			memcpy(&a.data[i*16], w, 16);
+		}
+		attribs.push_back(a);
+	}
+}
+
+static void putQword(vector<uint8> &out, uint32 a, uint32 b, uint32 c, uint32 d)
+{
+	uint32 q[4] = { a, b, c, d };
+	uint32 pos = out.size();
+	out.resize(pos + 16);
+	memcpy(&out[pos], q, 16);
+}
+
+/*
+ * One DMA chain per split. Every batch references its slice of the
+ * attribute arrays that follow the chain. Strip batches start two
+ * vertices before the previous one ends, so their slices overlap in
+ * the one shared array. walkSplit takes the whole array from the
+ * first batch's reference and skips the others.
+ */
+static void buildPs2Split(vector<uint8> &out, const vector<Ps2Attrib> &attribs,
+                          uint32 n, bool strip)
+{
+	uint32 numSlots = 0;
+	for (uint32 i = 0; i < attribs.size(); i++)
+		if ((attribs[i].type & 0xF) + 1 > numSlots)
+			numSlots = (attribs[i].type & 0xF) + 1;
+
+	/* batches start on a qword for every format */
+	uint32 batchSize = VU_BUFFER / numSlots;
+	if (batchSize > 256)
+		batchSize = 256;
+	if (strip)
+		batchSize -= (batchSize - 2) % 4;
+	else
+		batchSize -= batchSize % 12;
+
+	vector<uint32> starts;
+	vector<uint32> counts;
+	for (uint32 start = 0; start < n; ) {
+		uint32 count = n - start < batchSize ? n - start : batchSize;
+		starts.push_back(start);
+		counts.push_back(count);
+		if (start + count >= n)
 			break;
-		/* Vertex colors */
-		case 0x6D00C002:
-			size = nightColors.size();
-			nightColors.resize(size-2*4);
-			/* fall through */
-		case 0x6E00C002:
-			size = vertexColors.size();
-			vertexColors.resize(size-2*4);
-			break;
-		/* Normals */
-		case 0x6E008002:
-		case 0x6E008003:
-		case 0x6A008003:
-			size = normals.size();
-			normals.resize(size-2*3);
-			break;
-		/* Skin weights and indices*/
-		case 0x6C008004:
-		case 0x6C008003:
-		case 0x6C008001:
-			size = vertexBoneWeights.size();
-			vertexBoneWeights.resize(size-2*4);
-
-			size = vertexBoneIndices.size();
-			vertexBoneIndices.resize(size-2);
-			break;
-		default:
-			cout << "unknown data type: ";
-			cout << hex <<typesRead[i] << endl;
-			break;
+		start += strip ? count - 2 : count;
+	}
+
+	uint32 dataStart = starts.size()*(attribs.size()*2 + 2)*0x10;
+	vector<uint32> offsets(attribs.size());
+	uint32 dataSize = 0;
+	for (uint32 i = 0; i < attribs.size(); i++) {
+		offsets[i] = dataStart + dataSize;
+		dataSize += attribs[i].data.size();
+	}
+	out.reserve(dataStart + dataSize);
+
+	for (uint32 b = 0; b < starts.size(); b++) {
+		uint32 num = counts[b] & 0xFF;	// 256 is 0
+		for (uint32 i = 0; i < attribs.size(); i++) {
+			const Ps2Attrib &a = attribs[i];
+			uint32 qwc = (counts[b]*a.size + 0xF)/0x10;
+			putQword(out, DMA_REF | qwc,
+			         (offsets[i] + starts[b]*a.size)/0x10,
+			         VIF_STCYCL | 0x100 | numSlots,
+			         a.type | num << 16);
+			putQword(out, 0, 0, 0, 0);
 		}
+		bool last = b == starts.size()-1;
+		putQword(out, (last ? DMA_RET : DMA_CNT) | 1, 0, 0, 0);
+		putQword(out, VIF_ITOP | counts[b],
+		         b == 0 ? VIF_MSCALF : VIF_MSCNT,
+		         last ? VIF_FLUSH : 0, last ? VIF_FLUSH : 0);
+	}
+	for (uint32 i = 0; i < attribs.size(); i++)
+		out.insert(out.end(), attribs[i].data.begin(),
+		           attribs[i].data.end());
+}
+
+uint32 Geometry::writePs2NativeData(ostream &rw)
+{
+	Ps2Layout layout;
+	chooseLayout(layout, *this);
+
+	vector< vector<uint8> > splitData(splits.size());
+	uint32 structSize = 4;
+	for (uint32 i = 0; i < splits.size(); i++) {
+		vector<Ps2Attrib> attribs;
+		buildAttribs(attribs, *this, layout, splits[i].indices);
+		buildPs2Split(splitData[i], attribs, splits[i].indices.size(),
+		              faceType == FACETYPE_STRIP);
+		structSize += 8 + splitData[i].size();
+	}
+
+	HeaderInfo header;
+	header.build = version;
+	header.type = CHUNK_NATIVEDATA;
+	header.length = 12 + structSize;
+	uint32 bytesWritten = header.write(rw);
+	header.type = CHUNK_STRUCT;
+	header.length = structSize;
+	bytesWritten += header.write(rw);
+
+	bytesWritten += writeUInt32(PLATFORM_PS2, rw);
+	for (uint32 i = 0; i < splits.size(); i++) {
+		bytesWritten += writeUInt32(splitData[i].size(), rw);
+		bytesWritten += writeUInt32(0, rw);	// has section A data
+		rw.write((char *) &splitData[i][0], splitData[i].size());
+		bytesWritten += splitData[i].size();
 	}
+	return bytesWritten;
 }
 
 }
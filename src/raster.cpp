@@ -0,0 +1,1310 @@
+#include <cstring>
+#include <cstdlib>
+#include <cmath>
+#include <vector>
+#include <algorithm>
+
+#include <renderware.h>
+
+#ifdef __SSE2__
+  #include <emmintrin.h>
+#endif
+#ifdef __SSSE3__
+  #include <tmmintrin.h>
+#endif
+
+using namespace std;
+
+namespace rw {
+
+/*
+ * Pixel formats
+ *
+ * A format is described by the position and width of each of its
+ * channels. Missing channels have a width of 0, a missing alpha channel
+ * decodes to 0xFF. Luminance formats have the same layout in R, G and B.
+ * 32 bit pixels are stored as B, G, R, A in memory.
+ */
+
+template <uint32 Depth,
+          uint32 RShift, uint32 RBits, uint32 GShift, uint32 GBits,
+          uint32 BShift, uint32 BBits, uint32 AShift, uint32 ABits>
+struct PixelFormat
+{
+	enum {
+		depth = Depth,
+		rShift = RShift, rBits = RBits,
+		gShift = GShift, gBits = GBits,
+		bShift = BShift, bBits = BBits,
+		aShift = AShift, aBits = ABits,
+		luminance = RShift == GShift && GShift == BShift
+	};
+};
+
+typedef PixelFormat<16, 10,5, 5,5, 0,5, 15,1> Format1555;
+typedef PixelFormat<16, 11,5, 5,6, 0,5,  0,0> Format565;
+typedef PixelFormat<16,  8,4, 4,4, 0,4, 12,4> Format4444;
+typedef PixelFormat< 8,  0,8, 0,8, 0,8,  0,0> FormatLum8;
+typedef PixelFormat<32, 16,8, 8,8, 0,8, 24,8> Format8888;
+typedef PixelFormat<32, 16,8, 8,8, 0,8,  0,0> Format888;
+typedef PixelFormat<16, 10,5, 5,5, 0,5,  0,0> Format555;
+
+#define FORMATINFO(f) { f::depth,\
+	{ f::rShift, f::gShift, f::bShift, f::aShift },\
+	{ f::rBits, f::gBits, f::bBits, f::aBits } }
+
+/* indexed by (rasterFormat & RASTER_MASK) >> 8 */
+static const RasterFormatInfo rasterFormatInfo[16] = {
+	{ 0, { 0, 0, 0, 0 }, { 0, 0, 0, 0 } },	// RASTER_DEFAULT
+	FORMATINFO(Format1555),
+	FORMATINFO(Format565),
+	FORMATINFO(Format4444),
+	FORMATINFO(FormatLum8),
+	FORMATINFO(Format8888),
+	FORMATINFO(Format888),
+	{ 16, { 0, 0, 0, 0 }, { 0, 0, 0, 0 } },	// RASTER_16
+	{ 24, { 0, 0, 0, 0 }, { 0, 0, 0, 0 } },	// RASTER_24
+	{ 32, { 0, 0, 0, 0 }, { 0, 0, 0, 0 } },	// RASTER_32
+	FORMATINFO(Format555)
+};
+
+#undef FORMATINFO
+
+const RasterFormatInfo *getRasterFormatInfo(uint32 rasterFormat)
+{
+	return &rasterFormatInfo[(rasterFormat & RASTER_MASK) >> 8];
+}
+
+/* widens a channel of at least 4 bits to 8 bits by replicating its bits;
+ * same as v*0xFF/max, but rounded instead of truncated */
+template <uint32 Bits>
+struct Replicate
+{
+	static uint32 apply(uint32 v) { return v << (8-Bits) | v >> (2*Bits-8); }
+};
+
+template <> struct Replicate<1>
+{
+	static uint32 apply(uint32 v) { return v * 0xFF; }
+};
+
+template <> struct Replicate<0>
+{
+	static uint32 apply(uint32) { return 0; }
+};
+
+/* narrows an 8 bit channel, c*max/0xFF rounded to nearest */
+template <uint32 Bits>
+struct Narrow
+{
+	static uint32 apply(uint32 c)
+	{
+		uint32 t = c*((1 << Bits) - 1) + 128;
+		return (t + (t >> 8)) >> 8;
+	}
+};
+
+template <> struct Narrow<8>
+{
+	static uint32 apply(uint32 c) { return c; }
+};
+
+template <> struct Narrow<0>
+{
+	static uint32 apply(uint32) { return 0; }
+};
+
+template <uint32 Depth> struct PixelIO;
+
+template <> struct PixelIO<8>
+{
+	typedef uint8 Type;
+};
+
+template <> struct PixelIO<16>
+{
+	typedef uint16 Type;
+};
+
+template <> struct PixelIO<32>
+{
+	typedef uint32 Type;
+};
+
+template <class F>
+static inline uint32 decodePixel(uint32 pixel)
+{
+	uint32 r = Replicate<F::rBits>::apply(
+	             (pixel >> F::rShift) & ((1 << F::rBits) - 1));
+	uint32 g = Replicate<F::gBits>::apply(
+	             (pixel >> F::gShift) & ((1 << F::gBits) - 1));
+	uint32 b = Replicate<F::bBits>::apply(
+	             (pixel >> F::bShift) & ((1 << F::bBits) - 1));
+	uint32 a = F::aBits == 0 ? 0xFF : Replicate<F::aBits>::apply(
+	             (pixel >> F::aShift) & ((1 << F::aBits) - 1));
+	return b | g << 8 | r << 16 | a << 24;
+}
+
+template <class F>
+static inline uint32 encodePixel(uint32 c)
+{
+	uint32 r = (c >> 16) & 0xFF;
+	uint32 g = (c >> 8) & 0xFF;
+	uint32 b = c & 0xFF;
+	uint32 a = c >> 24;
+	if (F::luminance)
+		return Narrow<F::rBits>::apply((r*77 + g*150 + b*29) >> 8)
+		         << F::rShift;
+	uint32 pixel = Narrow<F::rBits>::apply(r) << F::rShift |
+	               Narrow<F::gBits>::apply(g) << F::gShift |
+	               Narrow<F::bBits>::apply(b) << F::bShift |
+	               Narrow<F::aBits>::apply(a) << F::aShift;
+	// X8R8G8B8, keep the unused byte opaque
+	if (F::depth == 32 && F::aBits == 0)
+		pixel |= 0xFF000000;
+	return pixel;
+}
+
+/* the loop body is branch free and gets vectorized by the compiler */
+template <class S, class D>
+static void convertPixels(uint8 *dst, const uint8 *src, uint32 n)
+{
+	typedef typename PixelIO<S::depth>::Type SrcType;
+	typedef typename PixelIO<D::depth>::Type DstType;
+	const SrcType *__restrict in = (const SrcType *) src;
+	DstType *__restrict out = (DstType *) dst;
+	for (uint32 i = 0; i < n; i++)
+		out[i] = encodePixel<D>(decodePixel<S>(in[i]));
+}
+
+template <class S>
+static bool convertFrom(uint8 *dst, const uint8 *src, uint32 n,
+                        uint32 dstFormat)
+{
+	switch (dstFormat & RASTER_MASK) {
+	case RASTER_1555: convertPixels<S, Format1555>(dst, src, n); break;
+	case RASTER_565:  convertPixels<S, Format565>(dst, src, n); break;
+	case RASTER_4444: convertPixels<S, Format4444>(dst, src, n); break;
+	case RASTER_LUM8: convertPixels<S, FormatLum8>(dst, src, n); break;
+	case RASTER_8888: convertPixels<S, Format8888>(dst, src, n); break;
+	case RASTER_888:  convertPixels<S, Format888>(dst, src, n); break;
+	case RASTER_555:  convertPixels<S, Format555>(dst, src, n); break;
+	default:
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Palettes
+ */
+
+/* palettes are stored as R, G, B, A; the lookup table holds B, G, R, A */
+static void makePaletteTable(uint32 *lut, const uint8 *palette, uint32 size)
+{
+	uint32 i;
+	for (i = 0; i < size; i++)
+		lut[i] = palette[i*4+2] | palette[i*4+1] << 8 |
+		         palette[i*4+0] << 16 | palette[i*4+3] << 24;
+	for (; i < 256; i++)
+		lut[i] = 0;
+}
+
+#ifdef __SSSE3__
+/* gathers 16 pixels at a time from a palette of at most 16 colors by using
+ * each byte plane of the palette as a pshufb table */
+static uint32 gatherPalette16(uint32 *out, const uint8 *src, uint32 n,
+                              const uint32 *lut)
+{
+	uint8 planes[4][16];
+	for (uint32 i = 0; i < 16; i++)
+		for (uint32 j = 0; j < 4; j++)
+			planes[j][i] = lut[i] >> (j*8);
+	__m128i p0 = _mm_loadu_si128((__m128i *) planes[0]);
+	__m128i p1 = _mm_loadu_si128((__m128i *) planes[1]);
+	__m128i p2 = _mm_loadu_si128((__m128i *) planes[2]);
+	__m128i p3 = _mm_loadu_si128((__m128i *) planes[3]);
+	__m128i mask = _mm_set1_epi8(0x0F);
+
+	uint32 i;
+	for (i = 0; i + 16 <= n; i += 16) {
+		__m128i idx = _mm_loadu_si128((__m128i *) (src+i));
+		idx = _mm_and_si128(idx, mask);
+		__m128i b = _mm_shuffle_epi8(p0, idx);
+		__m128i g = _mm_shuffle_epi8(p1, idx);
+		__m128i r = _mm_shuffle_epi8(p2, idx);
+		__m128i a = _mm_shuffle_epi8(p3, idx);
+		__m128i bgLo = _mm_unpacklo_epi8(b, g);
+		__m128i bgHi = _mm_unpackhi_epi8(b, g);
+		__m128i raLo = _mm_unpacklo_epi8(r, a);
+		__m128i raHi = _mm_unpackhi_epi8(r, a);
+		_mm_storeu_si128((__m128i *) (out+i+0),
+		                 _mm_unpacklo_epi16(bgLo, raLo));
+		_mm_storeu_si128((__m128i *) (out+i+4),
+		                 _mm_unpackhi_epi16(bgLo, raLo));
+		_mm_storeu_si128((__m128i *) (out+i+8),
+		                 _mm_unpacklo_epi16(bgHi, raHi));
+		_mm_storeu_si128((__m128i *) (out+i+12),
+		                 _mm_unpackhi_epi16(bgHi, raHi));
+	}
+	return i;
+}
+#endif
+
+/*
+ * Conversion kernels
+ */
+
+template <class T>
+static void gatherPalette(T *out, const uint8 *src, uint32 n, uint32 depth,
+                          const T *lut)
+{
+	if (depth == 4) {
+		// two indices per byte, low nibble first
+		for (uint32 i = 0; i < n/2; i++) {
+			out[i*2+0] = lut[src[i] & 0xF];
+			out[i*2+1] = lut[src[i] >> 4];
+		}
+		if (n & 1)
+			out[n-1] = lut[src[n/2] & 0xF];
+		return;
+	}
+
+	uint32 i;
+	for (i = 0; i + 4 <= n; i += 4) {
+		out[i+0] = lut[src[i+0]];
+		out[i+1] = lut[src[i+1]];
+		out[i+2] = lut[src[i+2]];
+		out[i+3] = lut[src[i+3]];
+	}
+	for (; i < n; i++)
+		out[i] = lut[src[i]];
+}
+
+/* the palette is converted to the destination format first,
+ * so every pixel is a single table lookup */
+bool expandPalette(uint8 *dst, const uint8 *src, uint32 n, uint32 depth,
+                   const uint8 *palette, uint32 paletteSize,
+                   uint32 dstFormat)
+{
+	uint32 lut[256];
+	makePaletteTable(lut, palette, paletteSize > 256 ? 256 : paletteSize);
+
+	const RasterFormatInfo *info = getRasterFormatInfo(dstFormat);
+	if ((dstFormat & RASTER_MASK) != RASTER_8888) {
+		uint32 lut8888[256];
+		memcpy(lut8888, lut, sizeof(lut));
+		if (!convertPixels((uint8 *) lut, (uint8 *) lut8888, 256,
+		                   RASTER_8888, dstFormat))
+			return false;
+	}
+
+	switch (info->depth) {
+	case 8:
+		gatherPalette(dst, src, n, depth, (uint8 *) lut);
+		break;
+	case 16:
+		gatherPalette((uint16 *) dst, src, n, depth, (uint16 *) lut);
+		break;
+	case 32: {
+		uint32 i = 0;
+#ifdef __SSSE3__
+		if (paletteSize <= 16 && depth == 8)
+			i = gatherPalette16((uint32 *) dst, src, n, lut);
+#endif
+		gatherPalette((uint32 *) dst + i, src + i, n - i, depth, lut);
+		break;
+	}
+	default:
+		return false;
+	}
+	return true;
+}
+
+bool convertPixels(uint8 *dst, const uint8 *src, uint32 n,
+                   uint32 srcFormat, uint32 dstFormat)
+{
+	if ((srcFormat & RASTER_MASK) == (dstFormat & RASTER_MASK)) {
+		memcpy(dst, src, n*getRasterFormatInfo(srcFormat)->depth/8);
+		return true;
+	}
+
+	switch (srcFormat & RASTER_MASK) {
+	case RASTER_1555: return convertFrom<Format1555>(dst, src, n, dstFormat);
+	case RASTER_565:  return convertFrom<Format565>(dst, src, n, dstFormat);
+	case RASTER_4444: return convertFrom<Format4444>(dst, src, n, dstFormat);
+	case RASTER_LUM8: return convertFrom<FormatLum8>(dst, src, n, dstFormat);
+	case RASTER_8888: return convertFrom<Format8888>(dst, src, n, dstFormat);
+	case RASTER_888:  return convertFrom<Format888>(dst, src, n, dstFormat);
+	case RASTER_555:  return convertFrom<Format555>(dst, src, n, dstFormat);
+	default:
+		return false;
+	}
+}
+
+/*
+ * Alpha classification
+ */
+
+static uint32 classifyScalar(const uint8 *pixels, uint32 n,
+                             bool &opaque, bool &mask)
+{
+	for (uint32 i = 0; i < n; i++) {
+		uint8 a = pixels[i*4+3];
+		opaque &= a == 0xFF;
+		mask &= a == 0xFF || a == 0;
+	}
+	return opaque ? ALPHA_OPAQUE : mask ? ALPHA_MASK : ALPHA_FULL;
+}
+
+/* 8888 pixels */
+uint32 classifyAlpha(const uint8 *pixels, uint32 n)
+{
+	bool opaque = true, mask = true;
+	uint32 i = 0;
+#ifdef __SSE2__
+	const __m128i amask = _mm_set1_epi32(0xFF000000);
+	const __m128i zero = _mm_setzero_si128();
+	__m128i allOpaque = _mm_cmpeq_epi32(zero, zero);
+	__m128i allMask = allOpaque;
+	for (; i+16 <= n; i += 16) {
+		const __m128i *p = (const __m128i *) &pixels[i*4];
+		for (uint32 j = 0; j < 4; j++) {
+			__m128i a = _mm_and_si128(_mm_loadu_si128(p+j), amask);
+			__m128i o = _mm_cmpeq_epi32(a, amask);
+			__m128i z = _mm_cmpeq_epi32(a, zero);
+			allOpaque = _mm_and_si128(allOpaque, o);
+			allMask = _mm_and_si128(allMask, _mm_or_si128(o, z));
+		}
+		// nothing left to find out
+		if ((i & 0x3F0) == 0 && _mm_movemask_epi8(allMask) != 0xFFFF)
+			return ALPHA_FULL;
+	}
+	opaque = _mm_movemask_epi8(allOpaque) == 0xFFFF;
+	mask = _mm_movemask_epi8(allMask) == 0xFFFF;
+#endif
+	return classifyScalar(&pixels[i*4], n - i, opaque, mask);
+}
+
+
+/*
+ * Palette quantization
+ *
+ * Colors are counted exactly first; if they don't fit into the palette
+ * the histogram is split by median cut. Pixels are 8888.
+ */
+
+struct ColorCount
+{
+	uint32 color;
+	uint32 count;
+};
+
+struct ChannelLess
+{
+	uint32 shift;
+	bool operator()(const ColorCount &a, const ColorCount &b) const {
+		return ((a.color >> shift) & 0xFF) < ((b.color >> shift) & 0xFF);
+	}
+};
+
+struct ColorBox
+{
+	uint32 begin, end;
+	uint32 shift;		// channel with the largest range
+	double score;		// roughly the error the box contributes
+};
+
+static void measureBox(ColorBox &box, const vector<ColorCount> &colors)
+{
+	uint32 lo[4] = { 0xFF, 0xFF, 0xFF, 0xFF };
+	uint32 hi[4] = { 0, 0, 0, 0 };
+	uint32 count = 0;
+	for (uint32 i = box.begin; i < box.end; i++) {
+		for (uint32 c = 0; c < 4; c++) {
+			uint32 v = (colors[i].color >> c*8) & 0xFF;
+			if (v < lo[c]) lo[c] = v;
+			if (v > hi[c]) hi[c] = v;
+		}
+		count += colors[i].count;
+	}
+	uint32 range = 0;
+	box.shift = 0;
+	for (uint32 c = 0; c < 4; c++)
+		if (hi[c] - lo[c] > range) {
+			range = hi[c] - lo[c];
+			box.shift = c*8;
+		}
+	box.score = (box.end - box.begin > 1) ?
+		(double) range*range*count : -1.0;
+}
+
+/* writes at most maxColors RGBA entries to palette and returns their
+ * number, 0 if the pixels don't fit and lossy is false */
+uint32 makePalette(uint8 *palette, uint32 maxColors,
+                   const uint8 *pixels, uint32 n, bool lossy)
+{
+	if (maxColors == 0)
+		return 0;
+	vector<uint32> sorted((const uint32 *) pixels,
+	                      (const uint32 *) pixels + n);
+	sort(sorted.begin(), sorted.end());
+
+	vector<ColorCount> colors;
+	for (uint32 i = 0; i < n; ) {
+		ColorCount cc;
+		cc.color = sorted[i];
+		cc.count = 0;
+		while (i < n && sorted[i] == cc.color) {
+			cc.count++;
+			i++;
+		}
+		colors.push_back(cc);
+	}
+	sorted.clear();
+
+	vector<ColorBox> boxes;
+	if (colors.size() <= maxColors) {
+		for (uint32 i = 0; i < colors.size(); i++) {
+			ColorBox box = { i, i+1, 0, -1.0 };
+			boxes.push_back(box);
+		}
+	} else {
+		if (!lossy)
+			return 0;
+		ColorBox box = { 0, (uint32) colors.size(), 0, 0.0 };
+		measureBox(box, colors);
+		boxes.push_back(box);
+		while (boxes.size() < maxColors) {
+			uint32 b = 0;
+			for (uint32 i = 1; i < boxes.size(); i++)
+				if (boxes[i].score > boxes[b].score)
+					b = i;
+			if (boxes[b].score < 0.0)
+				break;
+
+			ColorBox &lo = boxes[b];
+			ChannelLess less = { lo.shift };
+			sort(colors.begin()+lo.begin, colors.begin()+lo.end,
+			     less);
+			uint32 total = 0;
+			for (uint32 i = lo.begin; i < lo.end; i++)
+				total += colors[i].count;
+			// split at the weighted median, keep both halves filled
+			uint32 mid = lo.begin, sum = 0;
+			while (mid < lo.end-1 && sum + colors[mid].count <= total/2)
+				sum += colors[mid++].count;
+			if (mid == lo.begin)
+				mid++;
+
+			ColorBox hi = { mid, lo.end, 0, 0.0 };
+			lo.end = mid;
+			measureBox(lo, colors);
+			measureBox(hi, colors);
+			boxes.push_back(hi);
+		}
+	}
+
+	for (uint32 b = 0; b < boxes.size(); b++) {
+		double sum[4] = { 0.0, 0.0, 0.0, 0.0 };
+		double count = 0.0;
+		for (uint32 i = boxes[b].begin; i < boxes[b].end; i++) {
+			for (uint32 c = 0; c < 4; c++)
+				sum[c] += colors[i].count *
+				          (double) ((colors[i].color >> c*8) & 0xFF);
+			count += colors[i].count;
+		}
+		// BGRA to RGBA
+		palette[b*4+0] = sum[2]/count + 0.5;
+		palette[b*4+1] = sum[1]/count + 0.5;
+		palette[b*4+2] = sum[0]/count + 0.5;
+		palette[b*4+3] = sum[3]/count + 0.5;
+	}
+	return boxes.size();
+}
+
+static uint32 nearestColor(const int32 *pal, uint32 paletteSize,
+                           int32 r, int32 g, int32 b, int32 a)
+{
+	uint32 best = 0;
+	int32 bestDist = 0x7FFFFFFF;
+	for (uint32 i = 0; i < paletteSize; i++) {
+		int32 dr = pal[i*4+0] - r;
+		int32 dg = pal[i*4+1] - g;
+		int32 db = pal[i*4+2] - b;
+		int32 da = pal[i*4+3] - a;
+		int32 dist = dr*dr + dg*dg + db*db + da*da;
+		if (dist < bestDist) {
+			bestDist = dist;
+			best = i;
+			if (dist == 0)
+				break;
+		}
+	}
+	return best;
+}
+
+static inline int32 clampChannel(int32 v)
+{
+	return v < 0 ? 0 : v > 0xFF ? 0xFF : v;
+}
+
+/* one index byte per pixel, errors in R, G and B are diffused
+ * Floyd-Steinberg style when dithering, alpha is matched as is */
+void mapToPalette(uint8 *dst, const uint8 *pixels, uint32 width,
+                  uint32 height, const uint8 *palette, uint32 paletteSize,
+                  bool dither)
+{
+	int32 pal[256*4];
+	if (paletteSize > 256)
+		paletteSize = 256;
+	for (uint32 i = 0; i < paletteSize*4; i++)
+		pal[i] = palette[i];
+
+	// direct mapped cache of recent lookups
+	const uint32 cacheSize = 4096;
+	vector<uint32> cacheKey(cacheSize);
+	vector<int32> cacheIndex(cacheSize, -1);
+
+	vector<int32> err(dither ? (width+2)*3*2 : 0);
+	int32 *cur = dither ? &err[0] : 0;
+	int32 *next = dither ? &err[(width+2)*3] : 0;
+
+	for (uint32 y = 0; y < height; y++) {
+		if (dither)
+			for (uint32 i = 0; i < (width+2)*3; i++)
+				next[i] = 0;
+		for (uint32 x = 0; x < width; x++) {
+			const uint8 *p = &pixels[(y*width+x)*4];
+			int32 r = p[2], g = p[1], b = p[0], a = p[3];
+			if (dither) {
+				int32 *e = &cur[(x+1)*3];
+				r = clampChannel(r + e[0]/16);
+				g = clampChannel(g + e[1]/16);
+				b = clampChannel(b + e[2]/16);
+			}
+
+			uint32 key = a << 24 | r << 16 | g << 8 | b;
+			uint32 slot = (key * 2654435761u) >> 20;
+			uint32 idx;
+			if (cacheIndex[slot] >= 0 && cacheKey[slot] == key) {
+				idx = cacheIndex[slot];
+			} else {
+				idx = nearestColor(pal, paletteSize, r, g, b, a);
+				cacheKey[slot] = key;
+				cacheIndex[slot] = idx;
+			}
+			dst[y*width+x] = idx;
+
+			if (dither) {
+				int32 d[3] = { r - pal[idx*4+0],
+				               g - pal[idx*4+1],
+				               b - pal[idx*4+2] };
+				for (uint32 c = 0; c < 3; c++) {
+					cur[(x+2)*3+c] += d[c]*7;
+					next[(x+0)*3+c] += d[c]*3;
+					next[(x+1)*3+c] += d[c]*5;
+					next[(x+2)*3+c] += d[c]*1;
+				}
+			}
+		}
+		if (dither) {
+			int32 *t = cur;
+			cur = next;
+			next = t;
+		}
+	}
+}
+
+/*
+ * Resampling
+ *
+ * Separable filter over premultiplied float pixels, first along the
+ * rows, then along the columns. Both passes are split into bands of
+ * rows for parallelFor.
+ */
+
+#ifdef __SSE2__
+typedef __m128 Vec4;
+static inline Vec4 vzero(void) { return _mm_setzero_ps(); }
+static inline Vec4 vload(const float *p) { return _mm_loadu_ps(p); }
+static inline void vstore(float *p, Vec4 v) { _mm_storeu_ps(p, v); }
+static inline Vec4 vmadd(Vec4 acc, Vec4 v, float w)
+{
+	return _mm_add_ps(acc, _mm_mul_ps(v, _mm_set1_ps(w)));
+}
+#else
+struct Vec4 { float v[4]; };
+static inline Vec4 vzero(void) { Vec4 r = {{ 0, 0, 0, 0 }}; return r; }
+static inline Vec4 vload(const float *p)
+{
+	Vec4 r = {{ p[0], p[1], p[2], p[3] }};
+	return r;
+}
+static inline void vstore(float *p, Vec4 v) { memcpy(p, v.v, 16); }
+static inline Vec4 vmadd(Vec4 acc, Vec4 v, float w)
+{
+	for (uint32 c = 0; c < 4; c++)
+		acc.v[c] += v.v[c]*w;
+	return acc;
+}
+#endif
+
+/* every destination texel has taps source indices (clamped to the
+ * edge) and normalized weights */
+struct ResampleWeights
+{
+	uint32 taps;
+	vector<uint32> index;
+	vector<float> weight;
+};
+
+static float filterWeight(float x, uint32 filter)
+{
+	if (filter == RESAMPLE_BOX)
+		return (x >= -0.5f && x < 0.5f) ? 1.0f : 0.0f;
+	// Lanczos, three lobes
+	x = fabs(x);
+	if (x < 1e-5f)
+		return 1.0f;
+	if (x >= 3.0f)
+		return 0.0f;
+	float px = (float) M_PI * x;
+	return 3.0f*sin(px)*sin(px/3.0f) / (px*px);
+}
+
+static void makeWeights(ResampleWeights &w, uint32 srcN, uint32 dstN,
+                        uint32 filter)
+{
+	float scale = (float) srcN / dstN;
+	// widen the filter when shrinking
+	float fscale = max(scale, 1.0f);
+	float support = (filter == RESAMPLE_BOX ? 0.5f : 3.0f) * fscale;
+	w.taps = (uint32) ceil(support*2) + 1;
+	w.index.resize(dstN*w.taps);
+	w.weight.resize(dstN*w.taps);
+	for (uint32 i = 0; i < dstN; i++) {
+		float center = (i + 0.5f)*scale;
+		int32 start = (int32) floor(center - support);
+		float sum = 0.0f;
+		for (uint32 k = 0; k < w.taps; k++) {
+			int32 j = start + (int32) k;
+			float f = filterWeight((j + 0.5f - center)/fscale, filter);
+			w.index[i*w.taps+k] = min(max(j, 0), (int32) srcN-1);
+			w.weight[i*w.taps+k] = f;
+			sum += f;
+		}
+		if (sum != 0.0f)
+			for (uint32 k = 0; k < w.taps; k++)
+				w.weight[i*w.taps+k] /= sum;
+	}
+}
+
+struct ResampleJob
+{
+	uint8 *dst;
+	const uint8 *src;
+	uint32 srcWidth, srcHeight, dstWidth, dstHeight;
+	float *tmp;		// srcHeight rows of dstWidth pixels
+	ResampleWeights horiz, vert;
+};
+
+enum { RESAMPLE_BAND = 16 };
+
+static void premultiplyRow(float *dst, const uint8 *src, uint32 n)
+{
+	for (uint32 x = 0; x < n; x++) {
+		float a = src[x*4+3] / 255.0f;
+		dst[x*4+0] = src[x*4+0]*a;
+		dst[x*4+1] = src[x*4+1]*a;
+		dst[x*4+2] = src[x*4+2]*a;
+		dst[x*4+3] = src[x*4+3];
+	}
+}
+
+static void unpremultiplyRow(uint8 *dst, const float *src, uint32 n)
+{
+	for (uint32 x = 0; x < n; x++) {
+		float a = min(max(src[x*4+3], 0.0f), 255.0f);
+		float s = a > 0.5f ? 255.0f/a : 0.0f;
+		for (uint32 c = 0; c < 3; c++) {
+			float v = min(max(src[x*4+c]*s, 0.0f), 255.0f);
+			dst[x*4+c] = (uint8) (v + 0.5f);
+		}
+		dst[x*4+3] = (uint8) (a + 0.5f);
+	}
+}
+
+static void resampleRows(uint32 band, void *data)
+{
+	ResampleJob *job = (ResampleJob *) data;
+	const ResampleWeights &w = job->horiz;
+	vector<float> row(job->srcWidth*4);
+	uint32 end = min(job->srcHeight, (band+1)*RESAMPLE_BAND);
+	for (uint32 y = band*RESAMPLE_BAND; y < end; y++) {
+		premultiplyRow(&row[0], &job->src[y*job->srcWidth*4],
+		               job->srcWidth);
+		float *out = &job->tmp[y*job->dstWidth*4];
+		for (uint32 x = 0; x < job->dstWidth; x++) {
+			const uint32 *idx = &w.index[x*w.taps];
+			const float *wt = &w.weight[x*w.taps];
+			Vec4 acc = vzero();
+			for (uint32 k = 0; k < w.taps; k++)
+				acc = vmadd(acc, vload(&row[idx[k]*4]), wt[k]);
+			vstore(&out[x*4], acc);
+		}
+	}
+}
+
+static void resampleColumns(uint32 band, void *data)
+{
+	ResampleJob *job = (ResampleJob *) data;
+	const ResampleWeights &w = job->vert;
+	uint32 n = job->dstWidth*4;
+	vector<float> acc(n);
+	uint32 end = min(job->dstHeight, (band+1)*RESAMPLE_BAND);
+	for (uint32 y = band*RESAMPLE_BAND; y < end; y++) {
+		memset(&acc[0], 0, n*sizeof(float));
+		for (uint32 k = 0; k < w.taps; k++) {
+			float wt = w.weight[y*w.taps+k];
+			if (wt == 0.0f)
+				continue;
+			const float *row = &job->tmp[w.index[y*w.taps+k]*n];
+			for (uint32 x = 0; x < n; x += 4)
+				vstore(&acc[x], vmadd(vload(&acc[x]),
+				                      vload(&row[x]), wt));
+		}
+		unpremultiplyRow(&job->dst[y*job->dstWidth*4], &acc[0],
+		                 job->dstWidth);
+	}
+}
+
+void resamplePixels(uint8 *dst, uint32 dstWidth, uint32 dstHeight,
+                    const uint8 *src, uint32 srcWidth, uint32 srcHeight,
+                    uint32 filter)
+{
+	ResampleJob job;
+	job.dst = dst;
+	job.src = src;
+	job.srcWidth = srcWidth;
+	job.srcHeight = srcHeight;
+	job.dstWidth = dstWidth;
+	job.dstHeight = dstHeight;
+	makeWeights(job.horiz, srcWidth, dstWidth, filter);
+	makeWeights(job.vert, srcHeight, dstHeight, filter);
+	vector<float> tmp(srcHeight*dstWidth*4);
+	job.tmp = &tmp[0];
+	parallelFor((srcHeight + RESAMPLE_BAND-1)/RESAMPLE_BAND,
+	            resampleRows, &job);
+	parallelFor((dstHeight + RESAMPLE_BAND-1)/RESAMPLE_BAND,
+	            resampleColumns, &job);
+}
+
+/*
+ * DXT compression
+ *
+ * Colors are fit along their principal axis, then the endpoints are
+ * refined once by least squares. Indices always pick the closest of
+ * the colors the decoder in txdread.cpp produces.
+ */
+
+static uint32 pack565(const float *c)
+{
+	uint32 b = (uint32) (min(max(c[0], 0.0f), 255.0f)*31/255 + 0.5f);
+	uint32 g = (uint32) (min(max(c[1], 0.0f), 255.0f)*63/255 + 0.5f);
+	uint32 r = (uint32) (min(max(c[2], 0.0f), 255.0f)*31/255 + 0.5f);
+	return r << 11 | g << 5 | b;
+}
+
+static void unpack565(int32 *c, uint32 col)
+{
+	c[0] = (col & 0x1F)*0xFF/0x1F;
+	c[1] = ((col >> 5) & 0x3F)*0xFF/0x3F;
+	c[2] = (col >> 11)*0xFF/0x1F;
+}
+
+/* picks the indices for two endpoints and returns the error,
+ * transparent texels get index 3 in three color mode */
+static uint32 fitIndices(uint32 &indices, const uint8 *block,
+                         uint32 col0, uint32 col1, bool fourColors,
+                         uint32 transparent)
+{
+	int32 c[4][3];
+	unpack565(c[0], col0);
+	unpack565(c[1], col1);
+	for (uint32 i = 0; i < 3; i++)
+		if (fourColors) {
+			c[2][i] = (2*c[0][i] + c[1][i])/3;
+			c[3][i] = (c[0][i] + 2*c[1][i])/3;
+		} else {
+			c[2][i] = (c[0][i] + c[1][i])/2;
+			c[3][i] = 0;
+		}
+	uint32 n = fourColors ? 4 : 3;
+	uint32 error = 0;
+	indices = 0;
+	for (uint32 k = 0; k < 16; k++) {
+		if (transparent & 1 << k) {
+			indices |= 3 << k*2;
+			continue;
+		}
+		uint32 best = 0, bestError = ~0u;
+		for (uint32 j = 0; j < n; j++) {
+			int32 d0 = block[k*4+0] - c[j][0];
+			int32 d1 = block[k*4+1] - c[j][1];
+			int32 d2 = block[k*4+2] - c[j][2];
+			uint32 e = d0*d0 + d1*d1 + d2*d2;
+			if (e < bestError) {
+				bestError = e;
+				best = j;
+			}
+		}
+		indices |= best << k*2;
+		error += bestError;
+	}
+	return error;
+}
+
+/* four color mode needs col0 > col1, three color mode col0 <= col1 */
+static void orderEndpoints(uint32 &col0, uint32 &col1, bool fourColors)
+{
+	if (fourColors ? col0 < col1 : col0 > col1) {
+		uint32 t = col0;
+		col0 = col1;
+		col1 = t;
+	}
+}
+
+static void encodeColorBlock(uint8 *dst, const uint8 *block,
+                             bool punchThrough)
+{
+	uint32 transparent = 0;
+	float mean[3] = { 0, 0, 0 };
+	float lo[3] = { 255, 255, 255 }, hi[3] = { 0, 0, 0 };
+	uint32 n = 0;
+	for (uint32 k = 0; k < 16; k++) {
+		if (punchThrough && block[k*4+3] < 0x80) {
+			transparent |= 1 << k;
+			continue;
+		}
+		for (uint32 i = 0; i < 3; i++) {
+			mean[i] += block[k*4+i];
+			lo[i] = min(lo[i], (float) block[k*4+i]);
+			hi[i] = max(hi[i], (float) block[k*4+i]);
+		}
+		n++;
+	}
+	bool fourColors = transparent == 0;
+	uint32 col0 = 0, col1 = 0, indices = 0xFFFFFFFF;
+	if (n > 0) {
+		for (uint32 i = 0; i < 3; i++)
+			mean[i] /= n;
+		float cov[6] = { 0, 0, 0, 0, 0, 0 };
+		for (uint32 k = 0; k < 16; k++) {
+			if (transparent & 1 << k)
+				continue;
+			float d[3];
+			for (uint32 i = 0; i < 3; i++)
+				d[i] = block[k*4+i] - mean[i];
+			cov[0] += d[0]*d[0]; cov[1] += d[0]*d[1];
+			cov[2] += d[0]*d[2]; cov[3] += d[1]*d[1];
+			cov[4] += d[1]*d[2]; cov[5] += d[2]*d[2];
+		}
+		// power iteration for the principal axis
+		float axis[3] = { hi[0]-lo[0], hi[1]-lo[1], hi[2]-lo[2] };
+		for (uint32 it = 0; it < 8; it++) {
+			float v[3];
+			v[0] = cov[0]*axis[0] + cov[1]*axis[1] + cov[2]*axis[2];
+			v[1] = cov[1]*axis[0] + cov[3]*axis[1] + cov[4]*axis[2];
+			v[2] = cov[2]*axis[0] + cov[4]*axis[1] + cov[5]*axis[2];
+			float len = max(max(fabs(v[0]), fabs(v[1])), fabs(v[2]));
+			if (len == 0.0f)
+				break;
+			for (uint32 i = 0; i < 3; i++)
+				axis[i] = v[i]/len;
+		}
+		float len2 = axis[0]*axis[0] + axis[1]*axis[1] +
+		             axis[2]*axis[2];
+		float tmin = 0.0f, tmax = 0.0f;
+		if (len2 > 0.0f)
+			for (uint32 k = 0; k < 16; k++) {
+				if (transparent & 1 << k)
+					continue;
+				float t = 0.0f;
+				for (uint32 i = 0; i < 3; i++)
+					t += (block[k*4+i] - mean[i])*axis[i];
+				t /= len2;
+				tmin = min(tmin, t);
+				tmax = max(tmax, t);
+			}
+		float e0[3], e1[3];
+		for (uint32 i = 0; i < 3; i++) {
+			e0[i] = mean[i] + tmax*axis[i];
+			e1[i] = mean[i] + tmin*axis[i];
+		}
+		col0 = pack565(e0);
+		col1 = pack565(e1);
+		orderEndpoints(col0, col1, fourColors);
+		uint32 error = fitIndices(indices, block, col0, col1,
+		                          fourColors, transparent);
+
+		// least squares endpoints for these indices
+		static const float weights4[4] = { 1.0f, 0.0f, 2/3.0f, 1/3.0f };
+		static const float weights3[4] = { 1.0f, 0.0f, 0.5f, 0.0f };
+		const float *wt = fourColors ? weights4 : weights3;
+		float aa = 0, ab = 0, bb = 0, ax[3] = { 0, 0, 0 };
+		float bx[3] = { 0, 0, 0 };
+		for (uint32 k = 0; k < 16; k++) {
+			if (transparent & 1 << k)
+				continue;
+			float a = wt[indices >> k*2 & 3], b = 1.0f - a;
+			aa += a*a; ab += a*b; bb += b*b;
+			for (uint32 i = 0; i < 3; i++) {
+				ax[i] += a*block[k*4+i];
+				bx[i] += b*block[k*4+i];
+			}
+		}
+		float det = aa*bb - ab*ab;
+		if (fabs(det) > 1e-6f && col0 != col1) {
+			for (uint32 i = 0; i < 3; i++) {
+				e0[i] = (ax[i]*bb - bx[i]*ab)/det;
+				e1[i] = (bx[i]*aa - ax[i]*ab)/det;
+			}
+			uint32 lsCol0 = pack565(e0), lsCol1 = pack565(e1);
+			orderEndpoints(lsCol0, lsCol1, fourColors);
+			uint32 lsIndices;
+			uint32 lsError = fitIndices(lsIndices, block, lsCol0,
+			                            lsCol1, fourColors,
+			                            transparent);
+			if (lsError < error) {
+				col0 = lsCol0;
+				col1 = lsCol1;
+				indices = lsIndices;
+			}
+		}
+		// equal endpoints would switch to three color mode
+		if (col0 == col1 && fourColors)
+			indices = 0;
+	}
+	dst[0] = col0;
+	dst[1] = col0 >> 8;
+	dst[2] = col1;
+	dst[3] = col1 >> 8;
+	dst[4] = indices;
+	dst[5] = indices >> 8;
+	dst[6] = indices >> 16;
+	dst[7] = indices >> 24;
+}
+
+static void encodeAlphaDxt3(uint8 *dst, const uint8 *block)
+{
+	for (uint32 k = 0; k < 16; k += 2)
+		dst[k/2] = (block[k*4+3] + 8)/17 |
+		           ((block[k*4+7] + 8)/17) << 4;
+}
+
+static void encodeAlphaDxt5(uint8 *dst, const uint8 *block)
+{
+	uint32 a[8];
+	a[0] = 0;
+	a[1] = 0xFF;
+	for (uint32 k = 0; k < 16; k++) {
+		a[0] = max(a[0], (uint32) block[k*4+3]);
+		a[1] = min(a[1], (uint32) block[k*4+3]);
+	}
+	dst[0] = a[0];
+	dst[1] = a[1];
+	memset(&dst[2], 0, 6);
+	if (a[0] == a[1])
+		return;
+	for (uint32 k = 1; k < 7; k++)
+		a[k+1] = ((7-k)*a[0] + k*a[1])/7;
+	uint64 indices = 0;
+	for (uint32 k = 0; k < 16; k++) {
+		uint32 best = 0, bestError = ~0u;
+		for (uint32 j = 0; j < 8; j++) {
+			uint32 e = abs((int32) block[k*4+3] - (int32) a[j]);
+			if (e < bestError) {
+				bestError = e;
+				best = j;
+			}
+		}
+		indices |= (uint64) best << k*3;
+	}
+	for (uint32 j = 0; j < 6; j++)
+		dst[2+j] = indices >> j*8;
+}
+
+struct DxtJob
+{
+	uint8 *dst;
+	const uint8 *pixels;
+	uint32 width, height;
+	uint32 dxt;
+	bool punchThrough;
+};
+
+static void compressDxtRow(uint32 by, void *data)
+{
+	DxtJob *job = (DxtJob *) data;
+	uint32 blocksX = max(1u, (job->width+3)/4);
+	uint32 blockSize = job->dxt == 1 ? 8 : 16;
+	uint8 *dst = &job->dst[by*blocksX*blockSize];
+	for (uint32 bx = 0; bx < blocksX; bx++) {
+		// edge texels are repeated to fill the block
+		uint8 block[16*4];
+		for (uint32 y = 0; y < 4; y++)
+			for (uint32 x = 0; x < 4; x++) {
+				uint32 sx = min(bx*4+x, job->width-1);
+				uint32 sy = min(by*4+y, job->height-1);
+				memcpy(&block[(y*4+x)*4],
+				       &job->pixels[(sy*job->width+sx)*4], 4);
+			}
+		if (job->dxt == 1) {
+			encodeColorBlock(dst, block, job->punchThrough);
+		} else {
+			if (job->dxt == 3)
+				encodeAlphaDxt3(dst, block);
+			else
+				encodeAlphaDxt5(dst, block);
+			encodeColorBlock(dst+8, block, false);
+		}
+		dst += blockSize;
+	}
+}
+
+void compressDxt(uint8 *dst, const uint8 *pixels, uint32 width,
+                 uint32 height, uint32 dxt, bool punchThrough)
+{
+	DxtJob job;
+	job.dst = dst;
+	job.pixels = pixels;
+	job.width = width;
+	job.height = height;
+	job.dxt = dxt;
+	job.punchThrough = punchThrough;
+	parallelFor(max(1u, (height+3)/4), compressDxtRow, &job);
+}
+
+/*
+ * PS2 swizzling
+ *
+ * 4 and 8 bit textures are uploaded as PSMCT32 at half their size, so
+ * the indices end up in PSMT8 order. Inside a 16x16 block every texel
+ * lands on a fixed row (in units of two strides) and column, these
+ * tables hold both; the blocks themselves are laid out linearly.
+ * The formula they come from is the one from the ps2 linux website.
+ */
+
+struct Ps2SwizzleTables
+{
+	uint32 row[16];
+	uint32 column[16][16];
+	uint8 clut[256];	// CLUT entries 8-15 and 16-23 are swapped
+	uint8 identity[256];
+
+	Ps2SwizzleTables(void) {
+		for (uint32 y = 0; y < 16; y++) {
+			uint32 swapSel = (((y+2)>>2)&0x01)*4;
+			row[y] = (((y&(~3))>>1) + (y&1))&0x07;
+			for (uint32 x = 0; x < 16; x++)
+				column[y][x] = ((x+swapSel)&0x07)*4 +
+				               ((y>>1)&1) + ((x>>2)&2);
+		}
+		uint8 map[4] = { 0, 16, 8, 24 };
+		for (uint32 i = 0; i < 256; i++) {
+			clut[i] = (i & ~0x18) | map[(i & 0x18) >> 3];
+			identity[i] = i;
+		}
+	}
+};
+
+static const Ps2SwizzleTables ps2Tables;
+
+template <uint32 Depth>
+static inline uint8 fetchIndex(const uint8 *src, uint32 i)
+{
+	if (Depth == 4)
+		return (src[i>>1] >> ((i&1)*4)) & 0x0F;
+	return src[i];
+}
+
+template <uint32 Depth>
+static inline void storeIndex(uint8 *dst, uint32 i, uint8 index)
+{
+	if (Depth == 4)
+		dst[i>>1] |= (index & 0x0F) << ((i&1)*4);
+	else
+		dst[i] = index;
+}
+
+template <uint32 Depth>
+static void unswizzleIndices(uint8 *dst, const uint8 *src, uint32 width,
+                             uint32 height, uint32 stride, bool swizzled,
+                             const uint8 *map)
+{
+	if (!swizzled) {
+		for (uint32 i = 0; i < width*height; i++)
+			dst[i] = map[fetchIndex<Depth>(src, i)];
+		return;
+	}
+
+	for (uint32 y = 0; y < height; y++) {
+		const uint32 *column = ps2Tables.column[y&15];
+		uint32 rowStart = (y&(~0x0F))*stride +
+		                  ps2Tables.row[y&15]*stride*2;
+		uint8 *out = &dst[y*width];
+		uint32 x = 0;
+		// whole blocks
+		for (; x + 16 <= width; x += 16) {
+			uint32 block = rowStart + x*2;
+			for (uint32 k = 0; k < 16; k++)
+				out[x+k] = map[fetchIndex<Depth>(src,
+				                                 block+column[k])];
+		}
+		for (; x < width; x++)
+			out[x] = map[fetchIndex<Depth>(src,
+			             rowStart + (x&(~0x0F))*2 + column[x&15])];
+	}
+}
+
+/* stride is the width of the swizzled image in texels,
+ * the CLUT fix only applies to 8 bit palettes */
+void unswizzlePs2(uint8 *dst, const uint8 *src, uint32 width,
+                  uint32 height, uint32 stride, uint32 depth, bool swizzled)
+{
+	if (depth == 4)
+		unswizzleIndices<4>(dst, src, width, height, stride,
+		                    swizzled, ps2Tables.identity);
+	else
+		unswizzleIndices<8>(dst, src, width, height, stride,
+		                    swizzled, ps2Tables.clut);
+}
+
+/* the inverse, dst holds the swizzled image and is cleared first */
+template <uint32 Depth>
+static void swizzleIndices(uint8 *dst, const uint8 *src, uint32 width,
+                           uint32 height, uint32 stride, bool swizzled,
+                           const uint8 *map)
+{
+	if (!swizzled) {
+		for (uint32 i = 0; i < width*height; i++)
+			storeIndex<Depth>(dst, i, map[src[i]]);
+		return;
+	}
+
+	for (uint32 y = 0; y < height; y++) {
+		const uint32 *column = ps2Tables.column[y&15];
+		uint32 rowStart = (y&(~0x0F))*stride +
+		                  ps2Tables.row[y&15]*stride*2;
+		const uint8 *in = &src[y*width];
+		for (uint32 x = 0; x < width; x++)
+			storeIndex<Depth>(dst,
+				rowStart + (x&(~0x0F))*2 + column[x&15],
+				map[in[x]]);
+	}
+}
+
+void swizzlePs2(uint8 *dst, const uint8 *src, uint32 width, uint32 height,
+                uint32 stride, uint32 depth, bool swizzled)
+{
+	uint32 size = swizzled ? stride*height : width*height;
+	memset(dst, 0, depth == 4 ? (size+1)/2 : size);
+	if (depth == 4)
+		swizzleIndices<4>(dst, src, width, height, stride,
+		                  swizzled, ps2Tables.identity);
+	else
+		swizzleIndices<8>(dst, src, width, height, stride,
+		                  swizzled, ps2Tables.clut);
+}
+
+/*
+ * Xbox swizzling
+ *
+ * Texel addresses interleave the bits of x and y, x first, as long as
+ * both have bits left; the rest of the larger dimension's bits go on
+ * top. Every coordinate is spread through a table once, an address is
+ * then a single OR.
+ */
+
+static bool makeMortonTables(vector<uint32> &xTab, vector<uint32> &yTab,
+                             uint32 width, uint32 height)
+{
+	if (width == 0 || height == 0 ||
+	    (width & (width-1)) || (height & (height-1)))
+		return false;
+	xTab.assign(width, 0);
+	yTab.assign(height, 0);
+	uint32 bit = 1;
+	for (uint32 i = 1; i < width || i < height; i <<= 1) {
+		if (i < width) {
+			for (uint32 x = 0; x < width; x++)
+				if (x & i)
+					xTab[x] |= bit;
+			bit <<= 1;
+		}
+		if (i < height) {
+			for (uint32 y = 0; y < height; y++)
+				if (y & i)
+					yTab[y] |= bit;
+			bit <<= 1;
+		}
+	}
+	return true;
+}
+
+template <class T>
+static void mortonCopy(T *dst, const T *src, uint32 width, uint32 height,
+                       const vector<uint32> &xTab, const vector<uint32> &yTab,
+                       bool swizzle)
+{
+	for (uint32 y = 0; y < height; y++) {
+		uint32 yOff = yTab[y];
+		if (swizzle)
+			for (uint32 x = 0; x < width; x++)
+				dst[yOff | xTab[x]] = src[y*width+x];
+		else
+			for (uint32 x = 0; x < width; x++)
+				dst[y*width+x] = src[yOff | xTab[x]];
+	}
+}
+
+static bool mortonTransform(uint8 *dst, const uint8 *src, uint32 width,
+                            uint32 height, uint32 depth, bool swizzle)
+{
+	vector<uint32> xTab, yTab;
+	if (!makeMortonTables(xTab, yTab, width, height))
+		return false;
+	switch (depth) {
+	case 8:
+		mortonCopy(dst, src, width, height, xTab, yTab, swizzle);
+		break;
+	case 16:
+		mortonCopy((uint16 *) dst, (const uint16 *) src,
+		           width, height, xTab, yTab, swizzle);
+		break;
+	case 32:
+		mortonCopy((uint32 *) dst, (const uint32 *) src,
+		           width, height, xTab, yTab, swizzle);
+		break;
+	default:
+		return false;
+	}
+	return true;
+}
+
+/* both fail for depths other than 8, 16, 32
+ * and dimensions that aren't powers of two */
+bool unswizzleXbox(uint8 *dst, const uint8 *src, uint32 width,
+                   uint32 height, uint32 depth)
+{
+	return mortonTransform(dst, src, width, height, depth, false);
+}
+
+bool swizzleXbox(uint8 *dst, const uint8 *src, uint32 width,
+                 uint32 height, uint32 depth)
+{
+	return mortonTransform(dst, src, width, height, depth, true);
+}
+
+}
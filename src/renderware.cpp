@@ -1,4 +1,11 @@
 #include <cstdlib>
+#include <pthread.h>
+#ifdef _WIN32
+  #define WIN32_LEAN_AND_MEAN
+  #include <windows.h>
+#else
+  #include <unistd.h>
+#endif
 
 #include <renderware.h>
 using namespace std;
@@ -259,4 +266,75 @@ getChunkName(uint32 i)
 		return "Unknown";
 }
 
+
+/*
+ * Threads
+ */
+
+uint32
+numProcessors(void)
+{
+#ifdef _WIN32
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return info.dwNumberOfProcessors;
+#else
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? n : 1;
+#endif
+}
+
+struct ParallelJob
+{
+	ParallelFunc func;
+	void *data;
+	uint32 count;
+	uint32 next;
+	pthread_mutex_t lock;
+};
+
+static void*
+parallelWorker(void *arg)
+{
+	ParallelJob *job = (ParallelJob*)arg;
+	for(;;){
+		pthread_mutex_lock(&job->lock);
+		uint32 i = job->next++;
+		pthread_mutex_unlock(&job->lock);
+		if(i >= job->count)
+			break;
+		job->func(i, job->data);
+	}
+	return 0;
+}
+
+/* indices are handed out one at a time, so uneven jobs balance out;
+ * the calling thread works too */
+void
+parallelFor(uint32 count, ParallelFunc func, void *data, uint32 numThreads)
+{
+	if(numThreads == 0)
+		numThreads = numProcessors();
+	if(numThreads > count)
+		numThreads = count;
+
+	ParallelJob job;
+	job.func = func;
+	job.data = data;
+	job.count = count;
+	job.next = 0;
+	pthread_mutex_init(&job.lock, 0);
+
+	std::vector<pthread_t> threads;
+	for(uint32 i = 1; i < numThreads; i++){
+		pthread_t t;
+		if(pthread_create(&t, 0, parallelWorker, &job) == 0)
+			threads.push_back(t);
+	}
+	parallelWorker(&job);
+	for(uint32 i = 0; i < threads.size(); i++)
+		pthread_join(threads[i], 0);
+	pthread_mutex_destroy(&job.lock);
+}
+
 }
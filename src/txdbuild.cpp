@@ -0,0 +1,175 @@
+#include <cstdlib>
+#include <cstdio>
+#include <cctype>
+#include <fstream>
+#include <algorithm>
+#include <dirent.h>
+#include <renderware.h>
+#include "args.h"
+
+using namespace std;
+using namespace rw;
+
+char *argv0;
+
+void
+usage(void)
+{
+	cerr << "usage: " << argv0 <<
+	        " [-9] [-o platform] [-v version_string] [-V version]" <<
+	        " [-j threads] dir out.txd\n";
+	cerr << "Builds a TXD from the .tga and .dds files in dir.\n";
+	cerr << "-9: Write Direct3D 9 TXD (for San Andreas).\n";
+	cerr << "-o: Output platform: d3d8, d3d9, ps2, xbox\n";
+	cerr << "-v: Known versions: GTA3, GTAVC_1, GTAVC_2, GTASA\n";
+	cerr << "-V: Set any version you like in hexadecimal.\n";
+	cerr << "-j: Number of threads, default is one per cpu.\n";
+	exit(1);
+}
+
+static bool
+hasExtension(const string &name, const char *ext)
+{
+	if(name.size() < 4)
+		return false;
+	string e = name.substr(name.size()-4);
+	for(uint32 i = 0; i < e.size(); i++)
+		e[i] = tolower((uint8) e[i]);
+	return e == ext;
+}
+
+struct BuildState
+{
+	uint32 platform;
+	vector<string> paths;
+	vector<NativeTexture> textures;
+	vector<uint8> loaded;
+};
+
+static void
+loadImage(uint32 i, void *data)
+{
+	BuildState *state = (BuildState *) data;
+	NativeTexture &tex = state->textures[i];
+	const string &path = state->paths[i];
+	bool ok = hasExtension(path, ".dds") ? tex.readDDS(path) :
+	                                       tex.readTGA(path);
+	if(!ok)
+		return;
+	// the PS2 writer only takes uncompressed textures
+	if(state->platform == PLATFORM_PS2){
+		if(tex.dxtCompression)
+			tex.decompressDxt();
+		tex.convertTo32Bit();
+	}
+	// opaque DXT3/5 becomes DXT1, opaque 8888 becomes 888
+	tex.fitAlphaFormat();
+	if(state->platform)
+		tex.platform = state->platform;
+	state->loaded[i] = true;
+}
+
+int
+main(int argc, char *argv[])
+{
+	if(sizeof(uint32) != 4 || sizeof(int32) != 4 ||
+	   sizeof(uint16) != 2 || sizeof(int16) != 2 ||
+	   sizeof(uint8)  != 1 || sizeof(int8)  != 1 ||
+	   sizeof(float32) != 4){
+		cerr << "type size not correct\n";
+		return 1;
+	}
+
+	uint32 platform = 0;
+	string platstring;
+	uint32 numThreads = 0;
+	version = VCPC;
+	string verstring;
+	ARGBEGIN{
+	case 'v':
+		verstring = EARGF(usage());
+		if(verstring == "GTA3")
+			version = GTA3_3;
+		else if(verstring == "GTAVC_1")
+			version = VCPS2;
+		else if(verstring == "GTAVC_2")
+			version = VCPC;
+		else if(verstring == "GTASA")
+			version = SA;
+		else{
+			cerr << "unknown version\n";
+			return 1;
+		}
+		break;
+	case 'V':
+		sscanf(EARGF(usage()), "%x", &version);
+		break;
+	case '9':
+		platform = PLATFORM_D3D9;
+		break;
+	case 'o':
+		platstring = EARGF(usage());
+		if(platstring == "d3d8")
+			platform = PLATFORM_D3D8;
+		else if(platstring == "d3d9")
+			platform = PLATFORM_D3D9;
+		else if(platstring == "ps2")
+			platform = PLATFORM_PS2;
+		else if(platstring == "xbox")
+			platform = PLATFORM_XBOX;
+		else{
+			cerr << "unknown platform\n";
+			return 1;
+		}
+		break;
+	case 'j':
+		numThreads = atoi(EARGF(usage()));
+		break;
+	default:
+		usage();
+	}ARGEND;
+
+	if(argc < 2)
+		usage();
+
+	string dirname = argv[0];
+	DIR *dir = opendir(argv[0]);
+	if(dir == 0){
+		cerr << "can't open directory " << dirname << endl;
+		return 1;
+	}
+	if(dirname[dirname.size()-1] != '/' &&
+	   dirname[dirname.size()-1] != '\\')
+		dirname += '/';
+	BuildState state;
+	state.platform = platform;
+	vector<string> names;
+	struct dirent *ent;
+	while((ent = readdir(dir)) != 0){
+		string name = ent->d_name;
+		if(hasExtension(name, ".tga") || hasExtension(name, ".dds"))
+			names.push_back(name);
+	}
+	closedir(dir);
+	// readdir has no particular order
+	sort(names.begin(), names.end());
+	for(uint32 i = 0; i < names.size(); i++)
+		state.paths.push_back(dirname + names[i]);
+
+	state.textures.resize(names.size());
+	state.loaded.resize(names.size(), 0);
+	parallelFor(names.size(), loadImage, &state, numThreads);
+
+	ofstream out(argv[1], ios::binary);
+	TextureDictionaryWriter writer;
+	writer.begin(out);
+	for(uint32 i = 0; i < state.textures.size(); i++){
+		if(!state.loaded[i])
+			continue;
+		writer.write(state.textures[i]);
+		NativeTexture empty;
+		state.textures[i].swap(empty);
+	}
+	writer.end();
+	out.close();
+}
@@ -1,5 +1,6 @@
 #include <cstdlib>
 #include <fstream>
+#include <algorithm>
 #include <renderware.h>
 #include "args.h"
 
@@ -12,14 +13,68 @@ void
 usage(void)
 {
 	cerr << "usage: " << argv0 <<
-	        " [-9] [-v version_string] [-V version] " <<
-	        " in.txd out.txd\n";
+	        " [-9] [-o platform] [-p[p]] [-v version_string] [-V version] " <<
+	        " [-s factor] [-m size] [-L] in.txd out.txd\n";
 	cerr << "-9: Write Direct3D 9 TXD (for San Andreas).\n";
+	cerr << "-o: Output platform: d3d8, d3d9, ps2, xbox\n";
+	cerr << "-p: Write paletted textures where no colors are lost.\n";
+	cerr << "-pp: Quantize and dither every texture to a palette.\n";
 	cerr << "-v: Known versions: GTA3, GTAVC_1, GTAVC_2, GTASA\n";
 	cerr << "-V: Set any version you like in hexadecimal.\n";
+	cerr << "-s: Divide width and height by factor.\n";
+	cerr << "-m: Halve textures until neither side is larger than size.\n";
+	cerr << "-L: Resample with a Lanczos filter instead of a box.\n";
 	exit(1);
 }
 
+struct ConvertState
+{
+	uint32 platform;
+	int pal;
+	uint32 factor;
+	uint32 maxSize;
+	uint32 filter;
+	TextureDictionaryWriter writer;
+};
+
+static void
+convertTexture(NativeTexture &tex, uint32, void *data)
+{
+	ConvertState *state = (ConvertState *) data;
+	if(tex.platform == PLATFORM_PS2)
+		tex.convertFromPS2(0x40);
+	if(tex.platform == PLATFORM_XBOX)
+		tex.convertFromXbox();
+	// resampling goes back to DXT unless the output can't have it
+	bool keepDxt = (state->factor > 1 || state->maxSize) &&
+	               !state->pal && state->platform != PLATFORM_PS2;
+	if(tex.dxtCompression && !keepDxt)
+		tex.decompressDxt();
+	if(!tex.dxtCompression)
+		tex.convertTo32Bit();
+
+	uint32 w = tex.width[0]/state->factor;
+	uint32 h = tex.height[0]/state->factor;
+	while(state->maxSize && (w > state->maxSize || h > state->maxSize)){
+		w /= 2;
+		h /= 2;
+	}
+	w = max(w, 1u);
+	h = max(h, 1u);
+	if(w != tex.width[0] || h != tex.height[0])
+		tex.resample(w, h, state->filter);
+	// the readers only guess whether there is alpha
+	tex.fitAlphaFormat();
+	if(state->pal && !tex.convertToPalette(RASTER_PAL4, false))
+		tex.convertToPalette(RASTER_PAL8, state->pal > 1);
+
+	if(state->platform)
+		tex.platform = state->platform;
+//	if(state->platform == PLATFORM_D3D9)
+//		tex.filterFlags = 0x1101;
+	state->writer.write(tex);
+}
+
 int
 main(int argc, char *argv[])
 {
@@ -31,7 +86,12 @@ main(int argc, char *argv[])
 		return 1;
 	}
 
-	int dx9 = 0;
+	uint32 platform = 0;
+	string platstring;
+	int pal = 0;
+	uint32 factor = 1;
+	uint32 maxSize = 0;
+	uint32 filter = RESAMPLE_BOX;
 	version = VCPC;
 	string verstring;
 	ARGBEGIN{
@@ -54,7 +114,36 @@ main(int argc, char *argv[])
 		sscanf(EARGF(usage()), "%x", &version);
 		break;
 	case '9':
-		dx9++;
+		platform = PLATFORM_D3D9;
+		break;
+	case 'o':
+		platstring = EARGF(usage());
+		if(platstring == "d3d8")
+			platform = PLATFORM_D3D8;
+		else if(platstring == "d3d9")
+			platform = PLATFORM_D3D9;
+		else if(platstring == "ps2")
+			platform = PLATFORM_PS2;
+		else if(platstring == "xbox")
+			platform = PLATFORM_XBOX;
+		else{
+			cerr << "unknown platform\n";
+			return 1;
+		}
+		break;
+	case 'p':
+		pal++;
+		break;
+	case 's':
+		factor = atoi(EARGF(usage()));
+		if(factor == 0)
+			usage();
+		break;
+	case 'm':
+		maxSize = atoi(EARGF(usage()));
+		break;
+	case 'L':
+		filter = RESAMPLE_LANCZOS;
 		break;
 	default:
 		usage();
@@ -65,28 +154,16 @@ main(int argc, char *argv[])
 
 	filename = argv[0];
 	ifstream rw(argv[0], ios::binary);
-	TextureDictionary *txd = new TextureDictionary;
-	txd->read(rw);
-	rw.close();
-	for(uint32 i = 0; i < txd->texList.size(); i++){
-		if(txd->texList[i].platform == PLATFORM_PS2)
-			txd->texList[i].convertFromPS2(0x40);
-		if(txd->texList[i].platform == PLATFORM_XBOX)
-			txd->texList[i].convertFromXbox();
-		if(txd->texList[i].dxtCompression)
-			txd->texList[i].decompressDxt();
-		txd->texList[i].convertTo32Bit();
-	}
-
 	ofstream out(argv[1], ios::binary);
-	
-	if(dx9)
-		for(uint32 i = 0; i < txd->texList.size(); i++){
-			txd->texList[i].platform = PLATFORM_D3D9;
-//			txd->texList[i].filterFlags = 0x1101;
-		}
-
-	txd->write(out);
+	ConvertState state;
+	state.platform = platform;
+	state.pal = pal;
+	state.factor = factor;
+	state.maxSize = maxSize;
+	state.filter = filter;
+	state.writer.begin(out);
+	TextureDictionary::readStream(rw, convertTexture, &state);
+	state.writer.end();
+	rw.close();
 	out.close();
-	delete txd;
 }
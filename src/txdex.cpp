@@ -1,9 +1,126 @@
+#include <cstdlib>
+#include <cstring>
+#include <cctype>
+#include <cstdio>
+#include <algorithm>
 #include <fstream>
 #include <renderware.h>
+#include "args.h"
+#ifdef _WIN32
+  #include <direct.h>
+#else
+  #include <sys/stat.h>
+#endif
 
 using namespace std;
 using namespace rw;
 
+char *argv0;
+
+static void
+usage(void)
+{
+	cerr << "usage: " << argv0 << " [-l] [-r] [-D] [-d dir] [-j threads] txd...\n";
+	cerr << "-l: Only list the textures, texels are not read.\n";
+	cerr << "-r: Write RLE compressed TGAs.\n";
+	cerr << "-D: Write DDS files, DXT textures stay compressed.\n";
+	cerr << "-d: Write the images into dir.\n";
+	cerr << "-j: Number of threads, default is one per cpu.\n";
+	exit(1);
+}
+
+static void
+listTexture(NativeTexture &t, uint32 i, void *)
+{
+	cout << i << " " << t.name << " " << t.maskName << " "
+		<< " " << t.width[0] << " " << t.height[0] << " "
+		<< " " << t.depth << " " << hex << t.rasterFormat << dec
+		<< " " << t.mipmapCount << endl;
+}
+
+static void
+makeDir(const string &dir)
+{
+#ifdef _WIN32
+	_mkdir(dir.c_str());
+#else
+	mkdir(dir.c_str(), 0777);
+#endif
+}
+
+/* texture names come from the file, keep them from escaping the
+ * output directory or colliding with each other */
+static void
+makeFileNames(TextureDictionary &txd, vector<string> &names)
+{
+	vector<string> lower;
+	for (uint32 i = 0; i < txd.texList.size(); i++) {
+		string name = txd.texList[i].name;
+		for (uint32 j = 0; j < name.size(); j++) {
+			char c = name[j];
+			if (!isalnum((uint8) c) && c != '_' && c != '-' &&
+			    c != '.' && c != ' ')
+				name[j] = '_';
+		}
+		if (name.empty() || name[0] == '.')
+			name = "tex" + name;
+
+		string low = name;
+		for (uint32 j = 0; j < low.size(); j++)
+			low[j] = tolower((uint8) low[j]);
+		if (find(lower.begin(), lower.end(), low) != lower.end()) {
+			char num[16];
+			sprintf(num, "_%d", i);
+			name += num;
+			low += num;
+		}
+		names.push_back(name);
+		lower.push_back(low);
+	}
+}
+
+struct ExtractState
+{
+	const char *path;
+	TextureDictionary *txd;
+	vector<string> *names;
+	string dir;
+	bool rle;
+	bool dds;
+};
+
+static void
+extractTexture(uint32 i, void *data)
+{
+	ExtractState *state = (ExtractState *) data;
+	NativeTexture &t = state->txd->texList[i];
+
+	ifstream rw(state->path, ios::binary);
+	if (!t.loadTexels(rw)) {
+		cerr << state->path << ": can't read " << t.name << endl;
+		return;
+	}
+	if (t.platform == PLATFORM_PS2)
+		t.convertFromPS2(0x40);
+	if (t.platform == PLATFORM_XBOX)
+		t.convertFromXbox();
+	string path = state->dir + (*state->names)[i];
+	if (state->dds) {
+		if (t.rasterFormat & (RASTER_PAL8 | RASTER_PAL4))
+			t.convertTo32Bit();
+		t.writeDDS(path + ".dds");
+	} else {
+		if (t.dxtCompression)
+			t.decompressDxt();
+		t.convertTo32Bit();
+		t.writeTGA(path + ".tga", state->rle);
+	}
+
+	// free the texels as soon as they're written
+	NativeTexture empty;
+	t.swap(empty);
+}
+
 int
 main(int argc, char *argv[])
 {
@@ -14,27 +131,64 @@ main(int argc, char *argv[])
 		cerr << "type size not correct\n";
 		return 1;
 	}
-	if (argc < 2) {
-		cerr << "Usage: " << argv[0] << " txd\n";
-		return 1;
+	bool list = false;
+	ExtractState state;
+	state.rle = false;
+	state.dds = false;
+	uint32 numThreads = 0;
+	ARGBEGIN{
+	case 'l':
+		list = true;
+		break;
+	case 'r':
+		state.rle = true;
+		break;
+	case 'D':
+		state.dds = true;
+		break;
+	case 'd':
+		state.dir = EARGF(usage());
+		break;
+	case 'j':
+		numThreads = atoi(EARGF(usage()));
+		break;
+	default:
+		usage();
+	}ARGEND;
+	if (argc < 1)
+		usage();
+
+	if (!state.dir.empty()) {
+		makeDir(state.dir);
+		char last = state.dir[state.dir.size()-1];
+		if (last != '/' && last != '\\')
+			state.dir += '/';
 	}
-	filename = argv[1];
-	ifstream rw(argv[1], ios::binary);
-	TextureDictionary txd;
-	txd.read(rw);
-	rw.close();
-	for (uint32 i = 0; i < txd.texList.size(); i++) {
-		NativeTexture &t = txd.texList[i];
-		cout << i << " " << t.name << " " << t.maskName << " "
-			<< " " << t.width[0] << " " << t.height[0] << " "
-			<< " " << t.depth << " " << hex << t.rasterFormat << endl;
-		if (txd.texList[i].platform == PLATFORM_PS2)
-			txd.texList[i].convertFromPS2(0x40);
-		if (txd.texList[i].platform == PLATFORM_XBOX)
-			txd.texList[i].convertFromXbox();
-		if (txd.texList[i].dxtCompression)
-			txd.texList[i].decompressDxt();
-		txd.texList[i].convertTo32Bit();
-		txd.texList[i].writeTGA();
+
+	for (int i = 0; i < argc; i++) {
+		filename = argv[i];
+		ifstream rw(argv[i], ios::binary);
+		if (argc > 1)
+			cout << argv[i] << ":\n";
+		if (list) {
+			TextureDictionary::readStream(rw, listTexture, 0,
+			                              false);
+			continue;
+		}
+
+		// read the headers only, the workers load the texels
+		TextureDictionary txd;
+		txd.read(rw, false);
+		rw.close();
+		for (uint32 j = 0; j < txd.texList.size(); j++)
+			listTexture(txd.texList[j], j, 0);
+
+		vector<string> names;
+		makeFileNames(txd, names);
+		state.path = argv[i];
+		state.txd = &txd;
+		state.names = &names;
+		parallelFor(txd.texList.size(), extractTexture, &state,
+		            numThreads);
 	}
 }
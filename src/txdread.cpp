@@ -1,21 +1,55 @@
 #include <cstring>
 #include <cstdlib>
 #include <fstream>
+#include <algorithm>
 #include <renderware.h>
 
 using namespace std;
 
 namespace rw {
 
-static void unclut(uint8 *texels, uint32 width, uint32 height);
-static void unswizzle8(uint8 *texels, uint8 *rawIndices,
-                       uint32 width, uint32 height);
 
 /*
  * Texture Dictionary
  */
 
-void TextureDictionary::read(istream &rw)
+static void readTextureNative(NativeTexture &tex, istream &rw,
+                              bool loadData)
+{
+	HeaderInfo header;
+
+	READ_HEADER(CHUNK_TEXTURENATIVE);
+	rw.seekg(0x0c, ios::cur);
+	tex.platform = readUInt32(rw);
+	rw.seekg(-0x10, ios::cur);
+
+	if (tex.platform == PLATFORM_XBOX) {
+		tex.readXbox(rw, loadData);
+	} else if (tex.platform == PLATFORM_D3D8 ||
+	           tex.platform == PLATFORM_D3D9) {
+		tex.readD3d(rw, loadData);
+	} else if (tex.platform == PLATFORM_PS2FOURCC) {
+		tex.platform = PLATFORM_PS2;
+		tex.readPs2(rw, loadData);
+	}
+
+	READ_HEADER(CHUNK_EXTENSION);
+	uint32 end = header.length;
+	end += rw.tellg();
+	while (rw.tellg() < end) {
+		header.read(rw);
+		switch (header.type) {
+		case CHUNK_SKYMIPMAP:
+			rw.seekg(4, ios::cur);
+			break;
+		default:
+			rw.seekg(header.length, ios::cur);
+			break;
+		}
+	}
+}
+
+void TextureDictionary::read(istream &rw, bool loadData)
 {
 	HeaderInfo header;
 
@@ -28,37 +62,31 @@ void TextureDictionary::read(istream &rw)
 	rw.seekg(2, ios::cur);
 	texList.resize(textureCount);
 
-	for (uint32 i = 0; i < textureCount; i++) {
-		READ_HEADER(CHUNK_TEXTURENATIVE);
-		rw.seekg(0x0c, ios::cur);
-		texList[i].platform = readUInt32(rw);
-		rw.seekg(-0x10, ios::cur);
-
-		if (texList[i].platform == PLATFORM_XBOX) {
-			texList[i].readXbox(rw);
-		} else if (texList[i].platform == PLATFORM_D3D8 ||
-		           texList[i].platform == PLATFORM_D3D9) {
-			texList[i].readD3d(rw);
-		} else if (texList[i].platform == PLATFORM_PS2FOURCC) {
-			texList[i].platform = PLATFORM_PS2;
-			texList[i].readPs2(rw);
-		}
+	for (uint32 i = 0; i < textureCount; i++)
+		readTextureNative(texList[i], rw, loadData);
+}
 
-		READ_HEADER(CHUNK_EXTENSION);
-		uint32 end = header.length;
-		end += rw.tellg();
-		while (rw.tellg() < end) {
-			header.read(rw);
-			switch (header.type) {
-			case CHUNK_SKYMIPMAP:
-				rw.seekg(4, ios::cur);
-				break;
-			default:
-				rw.seekg(header.length, ios::cur);
-				break;
-			}
-		}
+/* only one texture is in memory at a time,
+ * returns the number of textures read */
+uint32 TextureDictionary::readStream(istream &rw, TextureCallback callback,
+                                     void *data, bool loadData)
+{
+	HeaderInfo header;
+
+	header.read(rw);
+	if (header.type != CHUNK_TEXDICTIONARY)
+		return 0;
+
+	READ_HEADER(CHUNK_STRUCT);
+	uint32 textureCount = readUInt16(rw);
+	rw.seekg(2, ios::cur);
+
+	for (uint32 i = 0; i < textureCount; i++) {
+		NativeTexture tex;
+		readTextureNative(tex, rw, loadData);
+		callback(tex, i, data);
 	}
+	return textureCount;
 }
 
 void TextureDictionary::clear(void)
@@ -75,7 +103,69 @@ TextureDictionary::~TextureDictionary(void)
  * Native Texture
  */
 
-void NativeTexture::readD3d(istream &rw)
+/* only the position of the texels is remembered,
+ * loadTexels() reads them */
+static void readTexels(NativeTexture &tex, istream &rw, uint32 dataSize)
+{
+	tex.dataOffsets.push_back(rw.tellg());
+	tex.texels.push_back(0);
+	rw.seekg(dataSize, ios::cur);
+}
+
+/* reads the palette and all mipmaps into one buffer */
+bool NativeTexture::loadTexels(istream &rw)
+{
+	if (buffer)
+		return true;
+	uint32 pos = rw.tellg();
+	resizeTexels();
+	if (palette) {
+		rw.seekg(paletteOffset, ios::beg);
+		rw.read(reinterpret_cast <char *> (palette),
+		        paletteSize*4*sizeof(uint8));
+	}
+	for (uint32 i = 0; i < texels.size(); i++) {
+		rw.seekg(dataOffsets[i], ios::beg);
+		rw.read(reinterpret_cast <char *> (texels[i]),
+		        dataSizes[i]*sizeof(uint8));
+	}
+	rw.seekg(pos, ios::beg);
+	return !rw.fail();
+}
+
+/*
+ * Lays out the palette (paletteSize entries) and every mipmap
+ * (dataSizes) in one buffer, each part 16 byte aligned.
+ * The palette is copied over, the texels are not. The old buffer is
+ * returned so the caller can convert from it and free it afterwards.
+ * With inPlace the current buffer is reused if it is large enough
+ * and 0 is returned.
+ */
+uint8 *NativeTexture::resizeTexels(bool inPlace)
+{
+	uint32 size = (paletteSize*4 + 15) & ~15;
+	for (uint32 i = 0; i < texels.size(); i++)
+		size += (dataSizes[i] + 15) & ~15;
+
+	uint8 *oldbuffer = 0;
+	if (!inPlace || buffer == 0 || size > bufferSize) {
+		oldbuffer = buffer;
+		buffer = new uint8[size];
+		bufferSize = size;
+		if (palette && paletteSize)
+			memcpy(buffer, palette, paletteSize*4);
+	}
+
+	palette = paletteSize ? buffer : 0;
+	uint32 offset = (paletteSize*4 + 15) & ~15;
+	for (uint32 i = 0; i < texels.size(); i++) {
+		texels[i] = &buffer[offset];
+		offset += (dataSizes[i] + 15) & ~15;
+	}
+	return oldbuffer;
+}
+
+void NativeTexture::readD3d(istream &rw, bool loadData)
 {
 	HeaderInfo header;
 
@@ -131,9 +221,8 @@ void NativeTexture::readD3d(istream &rw)
 
 	if (rasterFormat & RASTER_PAL8 || rasterFormat & RASTER_PAL4) {
 		paletteSize = (rasterFormat & RASTER_PAL8) ? 0x100 : 0x10;
-		palette = new uint8[paletteSize*4*sizeof(uint8)];
-		rw.read(reinterpret_cast <char *> (palette),
-			paletteSize*4*sizeof(uint8));
+		paletteOffset = rw.tellg();
+		rw.seekg(paletteSize*4*sizeof(uint8), ios::cur);
 	}
 
 	for (uint32 i = 0; i < mipmapCount; i++) {
@@ -157,14 +246,14 @@ void NativeTexture::readD3d(istream &rw)
 			width[i] = height[i] = 0;
 
 		dataSizes.push_back(dataSize);
-		texels.push_back(new uint8[dataSize]);
-		rw.read(reinterpret_cast <char *> (&texels[i][0]),
-		        dataSize*sizeof(uint8));
+		readTexels(*this, rw, dataSize);
 	}
+	if (loadData)
+		loadTexels(rw);
 //cout << endl;
 }
 
-void NativeTexture::readXbox(istream &rw)
+void NativeTexture::readXbox(istream &rw, bool loadData)
 {
 	HeaderInfo header;
 
@@ -200,9 +289,8 @@ void NativeTexture::readXbox(istream &rw)
 
 	paletteSize = (rasterFormat & RASTER_PAL8) ? 0x100 :
 		      ((rasterFormat & RASTER_PAL4) ? 0x20 /* ! */ : 0);
-	palette = new uint8[paletteSize*4];
-	rw.read(reinterpret_cast <char *> (&palette[0]),
-		paletteSize*4*sizeof(uint8));
+	paletteOffset = rw.tellg();
+	rw.seekg(paletteSize*4*sizeof(uint8), ios::cur);
 
 	for (uint32 i = 0; i < mipmapCount; i++) {
 		if (i != 0) {
@@ -224,39 +312,26 @@ void NativeTexture::readXbox(istream &rw)
 			dataSizes[i] /= 2;
 		// else (0xe, 0xf) DXT3 (?)
 
-		texels.push_back(new uint8[dataSizes[i]]);
-		rw.read(reinterpret_cast <char *> (&texels[i][0]),
-			dataSizes[i]*sizeof(uint8));
+		readTexels(*this, rw, dataSizes[i]);
 	}
+	if (loadData)
+		loadTexels(rw);
 }
 
-void unswizzleXboxBlock(uint8 *out, uint8 *in, uint32 &outOff, uint32 inOff,
-                        uint32 width, uint32 height, uint32 stride)
+void NativeTexture::convertFromXbox(void)
 {
-	if (width < 2 || height < 2) {
-		memcpy(out+outOff, in+inOff, width*height);
-		inOff += width*height;
-	} else if (width == 2 && height == 2) {
-		*(out+outOff) = *(in+inOff);
-		*(out+outOff+1) = *(in+inOff+1);
-		*(out+outOff+stride) = *(in+inOff+2);
-		*(out+outOff+stride+1) = *(in+inOff+3);
-		inOff += 4;
-	} else {
-		unswizzleXboxBlock(out, in, inOff, outOff,
-		                   width/2, height/2, stride);
-		unswizzleXboxBlock(out, in, inOff, outOff + (width/2),
-		                   width/2, height/2, stride);
-		unswizzleXboxBlock(out, in, inOff, outOff + (height/2)*stride,
-		                   width/2, height/2, stride);
-		unswizzleXboxBlock(out, in, inOff,
-		                   outOff + (height/2)*stride + (width/2),
-		                   width/2, height/2, stride);
+	// uncompressed textures are stored in Morton order
+	if (dxtCompression == 0 &&
+	    (depth == 0x8 || depth == 0x10 || depth == 0x20)) {
+		std::vector<uint8*> oldtexels = texels;
+		uint8 *oldbuffer = resizeTexels();
+		for (uint32 i = 0; i < mipmapCount; i++)
+			if (!unswizzleXbox(texels[i], oldtexels[i], width[i],
+			                   height[i], depth))
+				memcpy(texels[i], oldtexels[i], dataSizes[i]);
+		delete[] oldbuffer;
 	}
-}
 
-void NativeTexture::convertFromXbox(void)
-{
 	if (dxtCompression == 0xc) {
 		dxtCompression = 1;
 		rasterFormat &= ~RASTER_MASK;
@@ -274,7 +349,7 @@ void NativeTexture::convertFromXbox(void)
 	platform = PLATFORM_D3D8;
 }
 
-void NativeTexture::readPs2(istream &rw)
+void NativeTexture::readPs2(istream &rw, bool loadData)
 {
 	HeaderInfo header;
 
@@ -288,16 +363,16 @@ void NativeTexture::readPs2(istream &rw)
 	filterFlags = readUInt32(rw);
 	
 	READ_HEADER(CHUNK_STRING);
-	char *buffer = new char[header.length+1];
-	rw.read(buffer, header.length);
-	name = buffer;
-	delete[] buffer;
+	char *str = new char[header.length+1];
+	rw.read(str, header.length);
+	name = str;
+	delete[] str;
 
 	READ_HEADER(CHUNK_STRING);
-	buffer = new char[header.length+1];
-	rw.read(buffer, header.length);
-	maskName = buffer;
-	delete[] buffer;
+	str = new char[header.length+1];
+	rw.read(str, header.length);
+	maskName = str;
+	delete[] str;
 
 	READ_HEADER(CHUNK_STRUCT);
 
@@ -379,9 +454,7 @@ void NativeTexture::readPs2(istream &rw)
 		}
 
 		dataSizes.push_back(dataSize);
-		texels.push_back(new uint8[dataSize]);
-		rw.read(reinterpret_cast <char *> (&texels[i][0]),
-		        dataSize*sizeof(uint8));
+		readTexels(*this, rw, dataSize);
 		i++;
 	}
 	mipmapCount = i;
@@ -402,15 +475,16 @@ void NativeTexture::readPs2(istream &rw)
 		}
 
 		paletteSize = (rasterFormat & RASTER_PAL8) ? 0x100 : 0x10;
-		palette = new uint8[paletteSize*4];
-		rw.read(reinterpret_cast <char *> (palette),
-			paletteSize*4*sizeof(uint8));
+		paletteOffset = rw.tellg();
+		rw.seekg(paletteSize*4*sizeof(uint8), ios::cur);
 
 		// need to work on 4bit palettes in vc & sa
 		if (unkh2 == 8 && unkh3 == 3 && unkh4 == 6)
 			rw.seekg(0x20, ios::cur);
 		// else 8 2 4
 	}
+	if (loadData)
+		loadTexels(rw);
 	rasterFormat &= 0xff00;
 	if ((rasterFormat & RASTER_8888) && !hasAlpha) {
 		rasterFormat &= ~RASTER_8888;
@@ -421,80 +495,406 @@ void NativeTexture::readPs2(istream &rw)
 
 void NativeTexture::convertTo32Bit(void)
 {
-	// depth is always 8 (even if the palette is 4 bit)
-	if (rasterFormat & RASTER_PAL8 || rasterFormat & RASTER_PAL4) {
-		for (uint32 j = 0; j < mipmapCount; j++) {
-			uint32 dataSize = width[j]*height[j]*4;
-			uint8 *newtexels = new uint8[dataSize];
-			for (uint32 i = 0; i < width[j]*height[j]; i++) {
-				// swap r and b
-				newtexels[i*4+2] = palette[texels[j][i]*4+0];
-				newtexels[i*4+1] = palette[texels[j][i]*4+1];
-				newtexels[i*4+0] = palette[texels[j][i]*4+2];
-				newtexels[i*4+3] = palette[texels[j][i]*4+3];
-			}
-			delete[] texels[j];
-			texels[j] = newtexels;
-			dataSizes[j] = dataSize;
+	uint32 format = rasterFormat & RASTER_MASK;
+	if (rasterFormat & RASTER_PAL8 || rasterFormat & RASTER_PAL4)
+		convertToFormat(format == RASTER_888 ? RASTER_888 : RASTER_8888);
+	else if (getRasterFormatInfo(format)->depth != 0x20)
+		convertToFormat(getRasterFormatInfo(format)->bits[3] ?
+		                RASTER_8888 : RASTER_888);
+}
+
+/* converts uncompressed textures between any of the formats
+ * described in raster.cpp, palettes are expanded */
+bool NativeTexture::convertToFormat(uint32 format)
+{
+	bool paletted = rasterFormat & RASTER_PAL8 ||
+	                rasterFormat & RASTER_PAL4;
+	const RasterFormatInfo *src = getRasterFormatInfo(rasterFormat);
+	const RasterFormatInfo *dst = getRasterFormatInfo(format);
+	if (dxtCompression || dst->bits[0] == 0 ||
+	    (!paletted && src->bits[0] == 0))
+		return false;
+	if (!paletted && src == dst)
+		return true;
+
+	std::vector<uint8*> oldtexels = texels;
+	std::vector<uint32> oldSizes = dataSizes;
+	uint8 *oldpalette = palette;
+	uint32 oldPaletteSize = paletteSize;
+	for (uint32 j = 0; j < mipmapCount; j++)
+		dataSizes[j] = width[j]*height[j]*dst->depth/8;
+	paletteSize = 0;
+	uint8 *oldbuffer = resizeTexels();
+
+	for (uint32 j = 0; j < mipmapCount; j++) {
+		uint32 n = width[j]*height[j];
+		// indices are usually one byte each, even for PAL4
+		if (paletted)
+			expandPalette(texels[j], oldtexels[j], n,
+			              oldSizes[j] < n ? 4 : 8,
+			              oldpalette, oldPaletteSize, format);
+		else
+			convertPixels(texels[j], oldtexels[j], n,
+			              rasterFormat, format);
+	}
+	delete[] oldbuffer;
+	rasterFormat &= ~(RASTER_PAL4 | RASTER_PAL8 | RASTER_MASK);
+	rasterFormat |= format & RASTER_MASK;
+	depth = dst->depth;
+	if (dst->bits[3] == 0)
+		hasAlpha = false;
+	return true;
+}
+
+/* quantizes an uncompressed texture to RASTER_PAL8 or RASTER_PAL4,
+ * fails without lossy if it has more colors than fit into the palette */
+bool NativeTexture::convertToPalette(uint32 format, bool lossy)
+{
+	uint32 maxColors = (format & RASTER_PAL4) ? 0x10 : 0x100;
+	if (dxtCompression || rasterFormat & (RASTER_PAL4 | RASTER_PAL8) ||
+	    getRasterFormatInfo(rasterFormat)->bits[0] == 0)
+		return false;
+
+	// all mipmaps share the palette
+	uint32 total = 0;
+	for (uint32 j = 0; j < mipmapCount; j++)
+		total += width[j]*height[j];
+	uint8 *pixels = new uint8[total*4];
+	uint32 offset = 0;
+	for (uint32 j = 0; j < mipmapCount; j++) {
+		convertPixels(&pixels[offset*4], texels[j], width[j]*height[j],
+		              rasterFormat, RASTER_8888);
+		offset += width[j]*height[j];
+	}
+
+	uint8 newpalette[0x100*4];
+	uint32 numColors = makePalette(newpalette, maxColors,
+	                               pixels, total, lossy);
+	if (numColors == 0) {
+		delete[] pixels;
+		return false;
+	}
+	memset(&newpalette[numColors*4], 0, (maxColors-numColors)*4);
+
+	// the indices are smaller than the texels, so this is in place
+	for (uint32 j = 0; j < mipmapCount; j++)
+		dataSizes[j] = width[j]*height[j];
+	paletteSize = maxColors;
+	palette = 0;
+	delete[] resizeTexels(true);
+	memcpy(palette, newpalette, paletteSize*4);
+
+	offset = 0;
+	for (uint32 j = 0; j < mipmapCount; j++) {
+		uint32 n = width[j]*height[j];
+		mapToPalette(texels[j], &pixels[offset*4], width[j], height[j],
+		             newpalette, numColors, lossy);
+		offset += n;
+	}
+	delete[] pixels;
+
+	hasAlpha = false;
+	for (uint32 i = 0; i < numColors; i++)
+		if (newpalette[i*4+3] != 0xFF)
+			hasAlpha = true;
+
+	rasterFormat &= RASTER_MIPMAP | RASTER_AUTOMIPMAP;
+	rasterFormat |= format & (RASTER_PAL4 | RASTER_PAL8);
+	rasterFormat |= hasAlpha ? RASTER_8888 : RASTER_888;
+	depth = (format & RASTER_PAL4) ? 0x4 : 0x8;
+	return true;
+}
+
+/* in DXT1 only blocks whose first color isn't larger than the second
+ * can have transparent texels, those with index 3 */
+static uint32 classifyDxt1(const uint8 *blocks, uint32 size)
+{
+	for (uint32 i = 0; i < size; i += 8) {
+		uint32 c0 = blocks[i] | blocks[i+1] << 8;
+		uint32 c1 = blocks[i+2] | blocks[i+3] << 8;
+		uint32 idx = blocks[i+4] | blocks[i+5] << 8 |
+		             blocks[i+6] << 16 | blocks[i+7] << 24;
+		if (c0 <= c1 && (idx & idx >> 1 & 0x55555555))
+			return ALPHA_MASK;
+	}
+	return ALPHA_OPAQUE;
+}
+
+static uint32 classifyDxt3(const uint8 *blocks, uint32 size)
+{
+	uint32 result = ALPHA_OPAQUE;
+	for (uint32 i = 0; i < size; i += 16)
+		for (uint32 j = 0; j < 8; j++) {
+			uint8 a = blocks[i+j];
+			if (a == 0xFF)
+				continue;
+			if (((a & 0xF) != 0 && (a & 0xF) != 0xF) ||
+			    ((a >> 4) != 0 && (a >> 4) != 0xF))
+				return ALPHA_FULL;
+			result = ALPHA_MASK;
 		}
-		delete[] palette;
-		palette = 0;
-		rasterFormat &= ~(RASTER_PAL4 | RASTER_PAL8);
-		depth = 0x20;
-	} else if ((rasterFormat & RASTER_MASK) ==  RASTER_1555) {
-		for (uint32 j = 0; j < mipmapCount; j++) {
-			uint32 dataSize = width[j]*height[j]*4;
-			uint8 *newtexels = new uint8[dataSize];
-			for (uint32 i = 0; i < width[j]*height[j]; i++) {
-				uint32 col = *((uint16 *) &texels[j][i*2]);
-				newtexels[i*4+0] =((col&0x001F)>>0x0)*0xFF/0x1F;
-				newtexels[i*4+1] =((col&0x03E0)>>0x5)*0xFF/0x1F;
-				newtexels[i*4+2] =((col&0x7C00)>>0xa)*0xFF/0x1F;
-				newtexels[i*4+3] =((col&0x8000)>>0xf)*0xFF;
-			}
-			delete[] texels[j];
-			texels[j] = newtexels;
-			dataSizes[j] = dataSize;
+	return result;
+}
+
+static uint32 classifyDxt5(const uint8 *blocks, uint32 size)
+{
+	uint32 result = ALPHA_OPAQUE;
+	for (uint32 i = 0; i < size; i += 16) {
+		uint32 a[8];
+		a[0] = blocks[i];
+		a[1] = blocks[i+1];
+		if (a[0] > a[1]) {
+			for (uint32 k = 1; k < 7; k++)
+				a[k+1] = ((7-k)*a[0] + k*a[1])/7;
+		} else {
+			for (uint32 k = 1; k < 5; k++)
+				a[k+1] = ((5-k)*a[0] + k*a[1])/5;
+			a[6] = 0;
+			a[7] = 0xFF;
 		}
-		rasterFormat = RASTER_8888;
-		depth = 0x20;
-	} else if ((rasterFormat & RASTER_MASK) ==  RASTER_565) {
+		uint64 idx = 0;
+		for (uint32 j = 0; j < 6; j++)
+			idx |= (uint64) blocks[i+2+j] << j*8;
+		for (uint32 j = 0; j < 16; j++) {
+			uint32 v = a[idx >> j*3 & 7];
+			if (v == 0xFF)
+				continue;
+			if (v != 0)
+				return ALPHA_FULL;
+			result = ALPHA_MASK;
+		}
+	}
+	return result;
+}
+
+/* looks at the texels to tell how alpha is used, also sets hasAlpha;
+ * textures that aren't loaded or still in a console layout count as
+ * ALPHA_FULL */
+uint32 NativeTexture::classifyAlpha(void)
+{
+	if ((platform != PLATFORM_D3D8 && platform != PLATFORM_D3D9) ||
+	    texels.empty() || texels[0] == 0)
+		return ALPHA_FULL;
+
+	uint32 result = ALPHA_OPAQUE;
+	if (rasterFormat & (RASTER_PAL8 | RASTER_PAL4)) {
+		// only the entries that are used count
+		bool used[256];
+		memset(used, 0, sizeof(used));
+		for (uint32 j = 0; j < mipmapCount; j++)
+			for (uint32 i = 0; i < dataSizes[j]; i++) {
+				uint8 idx = texels[j][i];
+				if (dataSizes[j] < width[j]*height[j]) {
+					used[idx & 0xF] = true;
+					used[idx >> 4] = true;
+				} else
+					used[idx] = true;
+			}
+		uint8 colors[256*4];
+		uint32 n = 0;
+		for (uint32 i = 0; i < paletteSize && i < 256; i++)
+			if (used[i])
+				memcpy(&colors[4*n++], &palette[i*4], 4);
+		result = rw::classifyAlpha(colors, n);
+	} else {
+		uint32 format = rasterFormat & RASTER_MASK;
+		const RasterFormatInfo *info = getRasterFormatInfo(format);
 		for (uint32 j = 0; j < mipmapCount; j++) {
-			uint32 dataSize = width[j]*height[j]*4;
-			uint8 *newtexels = new uint8[dataSize];
-			for (uint32 i = 0; i < width[j]*height[j]; i++) {
-				uint32 col = *((uint16 *) &texels[j][i*2]);
-				newtexels[i*4+0] =((col&0x001F)>>0x0)*0xFF/0x1F;
-				newtexels[i*4+1] =((col&0x07E0)>>0x5)*0xFF/0x3F;
-				newtexels[i*4+2] =((col&0xF800)>>0xb)*0xFF/0x1F;
-				newtexels[i*4+3] = 255;
+			uint32 n = width[j]*height[j];
+			uint32 r;
+			if (dxtCompression == 1)
+				r = classifyDxt1(texels[j], dataSizes[j]);
+			else if (dxtCompression == 2 || dxtCompression == 3)
+				r = classifyDxt3(texels[j], dataSizes[j]);
+			else if (dxtCompression)
+				r = classifyDxt5(texels[j], dataSizes[j]);
+			else if (format == RASTER_8888)
+				r = rw::classifyAlpha(texels[j], n);
+			else if (info->bits[3] == 0)
+				r = ALPHA_OPAQUE;
+			else {
+				// expand a few pixels at a time
+				uint8 tmp[256*4];
+				r = ALPHA_OPAQUE;
+				for (uint32 i = 0; i < n && r != ALPHA_FULL;
+				     i += 256) {
+					uint32 m = min(256u, n - i);
+					convertPixels(tmp,
+					              &texels[j][i*info->depth/8],
+					              m, format, RASTER_8888);
+					r = max(r, rw::classifyAlpha(tmp, m));
+				}
 			}
-			delete[] texels[j];
-			texels[j] = newtexels;
-			dataSizes[j] = dataSize;
+			result = max(result, r);
+			if (result == ALPHA_FULL)
+				break;
 		}
-		rasterFormat = RASTER_888;
-		depth = 0x20;
-	} else if ((rasterFormat & RASTER_MASK) ==  RASTER_4444) {
-		for (uint32 j = 0; j < mipmapCount; j++) {
-			uint32 dataSize = width[j]*height[j]*4;
-			uint8 *newtexels = new uint8[dataSize];
-			for (uint32 i = 0; i < width[j]*height[j]; i++) {
-				uint32 col = *((uint16 *) &texels[j][i*2]);
-				// swap r and b
-				newtexels[i*4+0] =((col&0x000F)>>0x0)*0xFF/0xF;
-				newtexels[i*4+1] =((col&0x00F0)>>0x4)*0xFF/0xF;
-				newtexels[i*4+2] =((col&0x0F00)>>0x8)*0xFF/0xF;
-				newtexels[i*4+3] =((col&0xF000)>>0xc)*0xFF/0xF;
+	}
+	hasAlpha = result != ALPHA_OPAQUE;
+	return result;
+}
+
+/* opaque DXT3/5 color blocks are decoded like DXT1 blocks in four
+ * color mode, so they only need the right color order */
+static void transcodeToDxt1(NativeTexture &tex)
+{
+	std::vector<uint8*> oldtexels = tex.texels;
+	for (uint32 j = 0; j < tex.mipmapCount; j++)
+		tex.dataSizes[j] /= 2;
+	// every block moves to a lower address, so this is in place
+	delete[] tex.resizeTexels(true);
+	for (uint32 j = 0; j < tex.mipmapCount; j++)
+		for (uint32 i = 0; i < tex.dataSizes[j]; i += 8) {
+			uint8 *b = &tex.texels[j][i];
+			memmove(b, &oldtexels[j][i*2+8], 8);
+			uint16 c0 = b[0] | b[1] << 8;
+			uint16 c1 = b[2] | b[3] << 8;
+			if (c0 > c1)
+				continue;
+			uint32 idx;
+			if (c0 == c1)
+				idx = 0;
+			else {
+				idx = b[4] | b[5] << 8 | b[6] << 16 | b[7] << 24;
+				// swap the colors and with them 0/1 and 2/3
+				idx ^= 0x55555555;
+				b[0] = c1;
+				b[1] = c1 >> 8;
+				b[2] = c0;
+				b[3] = c0 >> 8;
 			}
-			delete[] texels[j];
-			texels[j] = newtexels;
-			dataSizes[j] = dataSize;
+			b[4] = idx;
+			b[5] = idx >> 8;
+			b[6] = idx >> 16;
+			b[7] = idx >> 24;
 		}
-		rasterFormat = RASTER_8888;
-		depth = 0x20;
+	tex.dxtCompression = 1;
+}
+
+/*
+ * Picks the smallest format that keeps the texture's alpha: 888 for
+ * opaque 8888, 565 for opaque 1555 and 4444, 1555 for 4444 with a one
+ * bit mask and DXT1 for opaque DXT3/5. Returns whether anything changed.
+ */
+bool NativeTexture::fitAlphaFormat(void)
+{
+	uint32 alpha = classifyAlpha();
+	uint32 oldFormat = rasterFormat;
+	uint32 format = rasterFormat & RASTER_MASK;
+	uint32 newFormat = format;
+	bool transcoded = false;
+	if (rasterFormat & (RASTER_PAL8 | RASTER_PAL4))
+		newFormat = alpha == ALPHA_OPAQUE ? RASTER_888 : RASTER_8888;
+	else if (dxtCompression) {
+		if (dxtCompression != 1 && alpha == ALPHA_OPAQUE) {
+			transcodeToDxt1(*this);
+			transcoded = true;
+		}
+		if (dxtCompression == 1)
+			newFormat = alpha == ALPHA_OPAQUE ? RASTER_565 :
+			                                    RASTER_1555;
+	} else if (format == RASTER_8888 && alpha == ALPHA_OPAQUE)
+		newFormat = RASTER_888;
+	else if ((format == RASTER_1555 || format == RASTER_4444) &&
+	         alpha == ALPHA_OPAQUE)
+		return convertToFormat(RASTER_565);
+	else if (format == RASTER_4444 && alpha == ALPHA_MASK)
+		return convertToFormat(RASTER_1555);
+	rasterFormat = (rasterFormat & ~RASTER_MASK) | newFormat;
+	return transcoded || rasterFormat != oldFormat;
+}
+
+/* compresses a 32 bit texture to DXT1, 3 or 5 (4 is stored like 5) */
+bool NativeTexture::compressDxt(uint32 dxt)
+{
+	if (dxtCompression || depth != 32 || dxt < 1 || dxt > 5 ||
+	    rasterFormat & (RASTER_PAL8 | RASTER_PAL4))
+		return false;
+	if (dxt == 2)
+		dxt = 3;
+	bool alpha = dxt != 1 || classifyAlpha() != ALPHA_OPAQUE;
+	if ((rasterFormat & RASTER_MASK) == RASTER_888)
+		alpha = false;
+
+	std::vector<uint8*> oldtexels = texels;
+	std::vector<uint32> oldWidth = width, oldHeight = height;
+	for (uint32 j = 0; j < mipmapCount; j++) {
+		// DXT compression works on 4x4 blocks
+		width[j] = max(4u, width[j]);
+		height[j] = max(4u, height[j]);
+		dataSizes[j] = (width[j]+3)/4 * ((height[j]+3)/4) *
+		               (dxt == 1 ? 8 : 16);
 	}
-	// no support for other raster formats yet
+	uint8 *oldbuffer = resizeTexels();
+	for (uint32 j = 0; j < mipmapCount; j++)
+		rw::compressDxt(texels[j], oldtexels[j], oldWidth[j],
+		                oldHeight[j], dxt, dxt == 1 && alpha);
+	delete[] oldbuffer;
+
+	dxtCompression = dxt;
+	depth = 16;
+	hasAlpha = alpha;
+	rasterFormat &= ~RASTER_MASK;
+	if (dxt == 1)
+		rasterFormat |= alpha ? RASTER_1555 : RASTER_565;
+	else
+		rasterFormat |= RASTER_4444;
+	return true;
+}
+
+/*
+ * Scales the texture to newWidth x newHeight and rebuilds the mipmaps
+ * from the new base level. The texture is converted back to its
+ * raster format and compression afterwards, palettes are requantized.
+ */
+bool NativeTexture::resample(uint32 newWidth, uint32 newHeight,
+                             uint32 filter)
+{
+	if ((platform != PLATFORM_D3D8 && platform != PLATFORM_D3D9) ||
+	    texels.empty() || texels[0] == 0 ||
+	    newWidth == 0 || newHeight == 0)
+		return false;
+	uint32 dxt = dxtCompression;
+	uint32 format = rasterFormat & (RASTER_MASK | RASTER_PAL8 |
+	                                RASTER_PAL4);
+	decompressDxt();
+	if (dxtCompression || !convertToFormat(RASTER_8888))
+		return false;
+
+	// keep as many levels as before, if they fit
+	uint32 levels = 1;
+	if (mipmapCount > 1)
+		for (uint32 w = newWidth, h = newHeight;
+		     (w > 1 || h > 1) && levels < mipmapCount; levels++) {
+			w = max(1u, w/2);
+			h = max(1u, h/2);
+		}
+
+	uint8 *src = texels[0];
+	uint32 srcWidth = width[0], srcHeight = height[0];
+	mipmapCount = levels;
+	width.resize(levels);
+	height.resize(levels);
+	dataSizes.resize(levels);
+	texels.resize(levels);
+	for (uint32 j = 0; j < levels; j++) {
+		width[j] = j ? max(1u, width[j-1]/2) : newWidth;
+		height[j] = j ? max(1u, height[j-1]/2) : newHeight;
+		dataSizes[j] = width[j]*height[j]*4;
+	}
+	uint8 *oldbuffer = resizeTexels();
+	resamplePixels(texels[0], width[0], height[0],
+	               src, srcWidth, srcHeight, filter);
+	delete[] oldbuffer;
+	for (uint32 j = 1; j < levels; j++)
+		resamplePixels(texels[j], width[j], height[j],
+		               texels[j-1], width[j-1], height[j-1], filter);
+
+	if (dxt)
+		return compressDxt(dxt);
+	if (format & (RASTER_PAL8 | RASTER_PAL4))
+		return convertToPalette(format, true);
+	return convertToFormat(format);
 }
 
 void NativeTexture::convertFromPS2(uint32 aref)
@@ -502,32 +902,27 @@ void NativeTexture::convertFromPS2(uint32 aref)
 	if (platform != PLATFORM_PS2)
 		return;
 
+	// can't understand ps2 mipmaps
+	if(mipmapCount > 1){
+		mipmapCount = 1;
+		texels.resize(1);
+		dataSizes.resize(1);
+		height.resize(1);
+		width.resize(1);
+		rasterFormat &= ~(RASTER_AUTOMIPMAP | RASTER_MIPMAP);
+	}
+
 	for (uint32 j = 0; j < mipmapCount; j++) {
-		// can't understand mipmaps
-		if(j > 0){
-			delete[] texels[j];
-			continue;
-		}
-		bool swizzled = (swizzleHeight[j] != height[j]);
-
-		// converts to 8bpp, palette stays 4bit
-		if (depth == 0x4) {
-			uint8 *oldtexels = texels[j];
-			dataSizes[j] *= 2;
-			texels[j] = new uint8[dataSizes[j]];
-			for (uint32 i = 0; i < dataSizes[j]/2; i++) {
-				texels[j][i*2+0] = oldtexels[i] & 0x0F;
-				texels[j][i*2+1] = oldtexels[i] >> 4;
-			}
-			delete[] oldtexels;
-			depth = 0x8;
-
-			if (swizzled)
-				processPs2Swizzle(j);
-		} else if (depth == 0x8) {
-			if (swizzled)
-				processPs2Swizzle(j);
-			unclut(texels[j], width[j], height[j]);
+		if (depth == 0x4 || depth == 0x8) {
+			// palette stays 4bit
+			processPs2Swizzle(j);
+		} else if (depth == 0x10) {
+			uint16 *col = (uint16 *) texels[j];
+			for (uint32 i = 0; i < width[j]*height[j]; i++)
+				// swap R and B
+				col[i] = (col[i] & 0x83E0) |
+				         (col[i] & 0x001F) << 10 |
+				         (col[i] & 0x7C00) >> 10;
 		} else if (depth == 0x20) {
 			for (uint32 i = 0; i < width[j]*height[j]; i++) {
 				// swap R and B
@@ -543,14 +938,8 @@ void NativeTexture::convertFromPS2(uint32 aref)
 			}
 		}
 	}
-	// can't understand ps2 mipmaps
-	if(mipmapCount > 1){
-		mipmapCount = 1;
-		texels.resize(1);
-		height.resize(1);
-		width.resize(1);
-		rasterFormat &= ~(RASTER_AUTOMIPMAP | RASTER_MIPMAP);
-	}
+	if (depth == 0x4)
+		depth = 0x8;
 
 	if (rasterFormat & RASTER_PAL8 || rasterFormat & RASTER_PAL4) {
 		for (uint32 i = 0; i < paletteSize; i++) {
@@ -570,41 +959,38 @@ void NativeTexture::convertFromPS2(uint32 aref)
 	dxtCompression = 0;
 }
 
+/* converts the 4 or 8 bit indices of mip i to one byte
+ * per texel, unswizzled, cropped and in the normal CLUT order */
 void NativeTexture::processPs2Swizzle(uint32 i)
 {
-	dataSizes[i] = swizzleWidth[i] *
-	                 swizzleHeight[i] * 4;
-	uint8 *newtexels = new uint8[dataSizes[i]];
-	unswizzle8(newtexels, texels[i],
-	           swizzleWidth[i]*2,
-	           swizzleHeight[i]*2);
-	delete[] texels[i];
-	texels[i] = newtexels;
-
-	uint32 stride = swizzleWidth[i]*2;
-	if (stride != width[i]) {
-		dataSizes[i] = width[i]*height[i];
-		newtexels = new uint8[dataSizes[i]];
-		for (uint32 y = 0; y < height[i]; y++)
-			for (uint32 x = 0; x < width[i]; x++)
-				newtexels[y*width[i]+x] = texels[i][y*stride+x];
-		delete[] texels[i];
-		texels[i] = newtexels;
-	}
+	std::vector<uint8*> oldtexels = texels;
+	dataSizes[i] = width[i]*height[i];
+	uint8 *oldbuffer = resizeTexels();
+	for (uint32 j = 0; j < texels.size(); j++)
+		if (j != i)
+			memcpy(texels[j], oldtexels[j], dataSizes[j]);
+	unswizzlePs2(texels[i], oldtexels[i], width[i], height[i],
+	             swizzleWidth[i]*2, depth,
+	             swizzleHeight[i] != height[i]);
+	delete[] oldbuffer;
 }
 
 void NativeTexture::decompressDxt4(void)
 {
+	std::vector<uint8*> oldtexels = texels;
+	for (uint32 i = 0; i < mipmapCount; i++)
+		dataSizes[i] = width[i]*height[i]*4;
+	uint8 *oldbuffer = resizeTexels();
+
 	for (uint32 i = 0; i < mipmapCount; i++) {
 		/* j loops through old texels
 		 * x and y loop through new texels */
 		uint32 x = 0, y = 0;
-		uint32 dataSize = width[i]*height[i]*4;
-		uint8 *newtexels = new uint8[dataSize];
+		uint8 *newtexels = texels[i];
 		for (uint32 j = 0; j < width[i]*height[i]; j += 16) {
 			/* calculate colors */
-			uint32 col0 = *((uint16 *) &texels[i][j+8]);
-			uint32 col1 = *((uint16 *) &texels[i][j+10]);
+			uint32 col0 = *((uint16 *) &oldtexels[i][j+8]);
+			uint32 col1 = *((uint16 *) &oldtexels[i][j+10]);
 			uint32 c[4][4];
 			// swap r and b
 			c[0][0] = (col0 & 0x1F)*0xFF/0x1F;
@@ -624,8 +1010,8 @@ void NativeTexture::decompressDxt4(void)
 			c[3][2] = (1*c[0][2] + 2*c[1][2])/3;
 
 			uint32 a[8];
-			a[0] = texels[i][j+0];
-			a[1] = texels[i][j+1];
+			a[0] = oldtexels[i][j+0];
+			a[1] = oldtexels[i][j+1];
 			if (a[0] > a[1]) {
 				a[2] = (6*a[0] + 1*a[1])/7;
 				a[3] = (5*a[0] + 2*a[1])/7;
@@ -643,14 +1029,14 @@ void NativeTexture::decompressDxt4(void)
 			}
 
 			/* make index list */
-			uint32 indicesint = *((uint32 *) &texels[i][j+12]);
+			uint32 indicesint = *((uint32 *) &oldtexels[i][j+12]);
 			uint8 indices[16];
 			for (int32 k = 0; k < 16; k++) {
 				indices[k] = indicesint & 0x3;
 				indicesint >>= 2;
 			}
 			// actually 6 bytes
-			uint64 alphasint = *((uint64 *) &texels[i][j+2]);
+			uint64 alphasint = *((uint64 *) &oldtexels[i][j+2]);
 			uint8 alphas[16];
 			for (int32 k = 0; k < 16; k++) {
 				alphas[k] = alphasint & 0x7;
@@ -672,27 +1058,29 @@ void NativeTexture::decompressDxt4(void)
 				x = 0;
 			}
 		}
-		delete[] texels[i];
-		texels[i] = newtexels;
-		dataSizes[i] = dataSize;
 	}
+	delete[] oldbuffer;
 	depth = 0x20;
-	rasterFormat = RASTER_8888;
+	rasterFormat = (rasterFormat & ~RASTER_MASK) | RASTER_8888;
 	dxtCompression = 0;
 }
 
 void NativeTexture::decompressDxt3(void)
 {
+	std::vector<uint8*> oldtexels = texels;
+	for (uint32 i = 0; i < mipmapCount; i++)
+		dataSizes[i] = width[i]*height[i]*4;
+	uint8 *oldbuffer = resizeTexels();
+
 	for (uint32 i = 0; i < mipmapCount; i++) {
 		/* j loops through old texels
 		 * x and y loop through new texels */
 		uint32 x = 0, y = 0;
-		uint32 dataSize = width[i]*height[i]*4;
-		uint8 *newtexels = new uint8[dataSize];
+		uint8 *newtexels = texels[i];
 		for (uint32 j = 0; j < width[i]*height[i]; j += 16) {
 			/* calculate colors */
-			uint32 col0 = *((uint16 *) &texels[i][j+8]);
-			uint32 col1 = *((uint16 *) &texels[i][j+10]);
+			uint32 col0 = *((uint16 *) &oldtexels[i][j+8]);
+			uint32 col1 = *((uint16 *) &oldtexels[i][j+10]);
 			uint32 c[4][4];
 			// swap r and b
 			c[0][0] = (col0 & 0x1F)*0xFF/0x1F;
@@ -712,13 +1100,13 @@ void NativeTexture::decompressDxt3(void)
 			c[3][2] = (1*c[0][2] + 2*c[1][2])/3;
 
 			/* make index list */
-			uint32 indicesint = *((uint32 *) &texels[i][j+12]);
+			uint32 indicesint = *((uint32 *) &oldtexels[i][j+12]);
 			uint8 indices[16];
 			for (int32 k = 0; k < 16; k++) {
 				indices[k] = indicesint & 0x3;
 				indicesint >>= 2;
 			}
-			uint64 alphasint = *((uint64 *) &texels[i][j+0]);
+			uint64 alphasint = *((uint64 *) &oldtexels[i][j+0]);
 			uint8 alphas[16];
 			for (int32 k = 0; k < 16; k++) {
 				alphas[k] = (alphasint & 0xF)*17;
@@ -740,27 +1128,29 @@ void NativeTexture::decompressDxt3(void)
 				x = 0;
 			}
 		}
-		delete[] texels[i];
-		texels[i] = newtexels;
-		dataSizes[i] = dataSize;
 	}
+	delete[] oldbuffer;
 	depth = 0x20;
-	rasterFormat += 0x0200;
+	rasterFormat = (rasterFormat & ~RASTER_MASK) | RASTER_8888;
 	dxtCompression = 0;
 }
 
 void NativeTexture::decompressDxt1(void)
 {
+	std::vector<uint8*> oldtexels = texels;
+	for (uint32 i = 0; i < mipmapCount; i++)
+		dataSizes[i] = width[i]*height[i]*4;
+	uint8 *oldbuffer = resizeTexels();
+
 	for (uint32 i = 0; i < mipmapCount; i++) {
 		/* j loops through old texels
 		 * x and y loop through new texels */
 		uint32 x = 0, y = 0;
-		uint32 dataSize = width[i]*height[i]*4;
-		uint8 *newtexels = new uint8[dataSize];
+		uint8 *newtexels = texels[i];
 		for (uint32 j = 0; j < width[i]*height[i]/2; j += 8) {
 			/* calculate colors */
-			uint32 col0 = *((uint16 *) &texels[i][j+0]);
-			uint32 col1 = *((uint16 *) &texels[i][j+2]);
+			uint32 col0 = *((uint16 *) &oldtexels[i][j+0]);
+			uint32 col1 = *((uint16 *) &oldtexels[i][j+2]);
 			uint32 c[4][4];
 			// swap r and b
 			c[0][0] = (col0 & 0x1F)*0xFF/0x1F;
@@ -798,7 +1188,7 @@ void NativeTexture::decompressDxt1(void)
 			}
 
 			/* make index list */
-			uint32 indicesint = *((uint32 *) &texels[i][j+4]);
+			uint32 indicesint = *((uint32 *) &oldtexels[i][j+4]);
 			uint8 indices[16];
 			for (int32 k = 0; k < 16; k++) {
 				indices[k] = indicesint & 0x3;
@@ -820,10 +1210,8 @@ void NativeTexture::decompressDxt1(void)
 				x = 0;
 			}
 		}
-		delete[] texels[i];
-		texels[i] = newtexels;
-		dataSizes[i] = dataSize;
 	}
+	delete[] oldbuffer;
 	depth = 0x20;
 	rasterFormat += 0x0400;
 	dxtCompression = 0;
@@ -838,50 +1226,463 @@ void NativeTexture::decompressDxt(void)
 		decompressDxt1();
 	else if (dxtCompression == 3)
 		decompressDxt3();
-	else if (dxtCompression == 4) {
+	else if (dxtCompression == 4 || dxtCompression == 5) {
+		// same block layout, RW doesn't premultiply
 		decompressDxt4();
 	} else
 		cout << "dxt" << dxtCompression << " not supported\n";
 }
 
-void NativeTexture::writeTGA(void)
+/*
+ * Image import
+ */
+
+/* reads a whole file into memory */
+static uint8 *readFile(const string &path, uint32 &size)
 {
-	if (depth != 32) {
-		cout << "not writing file: " << filename << endl;
-		return;
+	ifstream f(path.c_str(), ios::binary);
+	if (!f)
+		return 0;
+	f.seekg(0, ios::end);
+	size = f.tellg();
+	f.seekg(0, ios::beg);
+	uint8 *data = new uint8[size];
+	f.read(reinterpret_cast <char *> (data), size);
+	if (f.fail()) {
+		delete[] data;
+		return 0;
 	}
-	char filename[36];
-	strcpy(filename, name.c_str());
-	strcat(filename, ".tga");
-	ofstream tga(filename, ios::binary);
+	return data;
+}
+
+/* name without directory and extension, short enough for a TXD */
+static string imageName(const string &path)
+{
+	string::size_type slash = path.find_last_of("/\\");
+	string name = slash == string::npos ? path : path.substr(slash+1);
+	string::size_type dot = name.rfind('.');
+	if (dot != string::npos && dot != 0)
+		name.erase(dot);
+	if (name.size() > 31)
+		name.erase(31);
+	return name;
+}
+
+/* larger images are rejected, this keeps all sizes well within 32 bits */
+#define IMAGE_MAX_DIM 0x4000
+
+/* bytes in a single level */
+static uint64 levelSize(uint32 w, uint32 h, uint32 depth,
+                        uint32 dxtCompression)
+{
+	if (dxtCompression)
+		return (uint64) max(1u, (w+3)/4) * max(1u, (h+3)/4) *
+		       (dxtCompression == 1 ? 8 : 16);
+	return (uint64) w*h*depth/8;
+}
+
+/* dimensions of the next smaller level */
+static void nextLevel(uint32 &w, uint32 &h, uint32 dxtCompression)
+{
+	w = max(1u, w/2);
+	h = max(1u, h/2);
+	// DXT compression works on 4x4 blocks
+	if (dxtCompression) {
+		w = max(4u, w);
+		h = max(4u, h);
+	}
+}
+
+/* bytes in all levels */
+static uint64 imageSize(uint32 w, uint32 h, uint32 levels, uint32 depth,
+                        uint32 dxtCompression)
+{
+	uint64 size = 0;
+	for (uint32 i = 0; i < levels; i++) {
+		size += levelSize(w, h, depth, dxtCompression);
+		nextLevel(w, h, dxtCompression);
+	}
+	return size;
+}
+
+/*
+ * clears the texture and sets up a D3D raster with allocated texels,
+ * dimensions have to be checked against IMAGE_MAX_DIM first
+ */
+static void initImage(NativeTexture &tex, const string &path,
+                      uint32 w, uint32 h, uint32 levels, uint32 depth,
+                      uint32 rasterFormat, uint32 dxtCompression)
+{
+	NativeTexture empty;
+	tex.swap(empty);
+	tex.platform = PLATFORM_D3D8;
+	tex.name = imageName(path);
+	tex.filterFlags = levels > 1 ? 0x1106 : 0x1102;
+	tex.rasterFormat = rasterFormat;
+	if (levels > 1)
+		tex.rasterFormat |= RASTER_MIPMAP;
+	tex.depth = depth;
+	tex.mipmapCount = levels;
+	tex.dxtCompression = dxtCompression;
+	for (uint32 i = 0; i < levels; i++) {
+		tex.width.push_back(w);
+		tex.height.push_back(h);
+		tex.dataSizes.push_back(levelSize(w, h, depth,
+		                                  dxtCompression));
+		tex.texels.push_back(0);
+		nextLevel(w, h, dxtCompression);
+	}
+	tex.resizeTexels();
+}
+
+/* reads uncompressed and RLE true color TGAs */
+bool NativeTexture::readTGA(const string &path)
+{
+	uint32 size;
+	uint8 *data = readFile(path, size);
+	if (data == 0) {
+		cerr << "can't read file: " << path << endl;
+		return false;
+	}
+	uint32 w = 0, h = 0, bpp = 0;
+	bool rle = false;
+	if (size >= 18) {
+		w = data[12] | data[13] << 8;
+		h = data[14] | data[15] << 8;
+		bpp = data[16] / 8;
+		rle = data[2] == 10;
+	}
+	if (size < 18 || data[1] != 0 || (data[2] != 2 && data[2] != 10) ||
+	    (bpp != 3 && bpp != 4) || w == 0 || h == 0 ||
+	    w > IMAGE_MAX_DIM || h > IMAGE_MAX_DIM || (data[17] & 0x10)) {
+		cerr << "unsupported TGA: " << path << endl;
+		delete[] data;
+		return false;
+	}
+	// an RLE packet holds at most 128 pixels
+	uint32 n = w*h;
+	uint64 minSize = 18 + data[0] +
+	                 (rle ? (n+127)/128*(1+bpp) : (uint64) n*bpp);
+	if (minSize > size) {
+		cerr << "truncated TGA: " << path << endl;
+		delete[] data;
+		return false;
+	}
+
+	initImage(*this, path, w, h, 1, 32, RASTER_8888, 0);
+	bool bottomUp = (data[17] & 0x20) == 0;
+	const uint8 *src = &data[18 + data[0]];
+	const uint8 *end = &data[size];
+	uint32 p = 0;
+	uint8 alpha = 0xFF;
+	while (p < n) {
+		uint32 count = n - p;
+		bool run = false;
+		if (rle) {
+			if (src >= end)
+				break;
+			count = min(n - p, (*src & 0x7Fu) + 1);
+			run = *src++ & 0x80;
+		}
+		if (src + (run ? 1 : count)*bpp > end)
+			break;
+		for (uint32 i = 0; i < count; i++, p++) {
+			uint32 y = p / w;
+			if (bottomUp)
+				y = h-1 - y;
+			uint8 *dst = &texels[0][(y*w + p%w)*4];
+			dst[0] = src[0];
+			dst[1] = src[1];
+			dst[2] = src[2];
+			dst[3] = bpp == 4 ? src[3] : 0xFF;
+			alpha &= dst[3];
+			if (!run)
+				src += bpp;
+		}
+		if (run)
+			src += bpp;
+	}
+	delete[] data;
+	if (p < n) {
+		cerr << "truncated TGA: " << path << endl;
+		return false;
+	}
+	hasAlpha = alpha != 0xFF;
+	if (!hasAlpha)
+		rasterFormat = (rasterFormat & ~RASTER_MASK) | RASTER_888;
+	return true;
+}
+
+/* DXGI formats that have a raster format */
+static const struct { uint32 dxgi, rasterFormat, dxt; } dxgiFormats[] = {
+	{ 71, RASTER_565, 1 }, { 72, RASTER_565, 1 },
+	{ 74, RASTER_4444, 3 }, { 75, RASTER_4444, 3 },
+	{ 77, RASTER_4444, 5 }, { 78, RASTER_4444, 5 },
+	{ 85, RASTER_565, 0 }, { 86, RASTER_1555, 0 },
+	{ 87, RASTER_8888, 0 }, { 88, RASTER_888, 0 },
+	{ 115, RASTER_4444, 0 }
+};
+
+/*
+ * Reads 2D DDS files. DXT1/3/5 blocks are kept as they are,
+ * uncompressed data has to match one of the raster formats.
+ */
+bool NativeTexture::readDDS(const string &path)
+{
+	uint32 size;
+	uint8 *data = readFile(path, size);
+	if (data == 0) {
+		cerr << "can't read file: " << path << endl;
+		return false;
+	}
+	uint32 header[37];
+	memset(header, 0, sizeof(header));
+	memcpy(header, data, min(size, (uint32) sizeof(header)));
+
+	uint32 offset = 128;
+	uint32 format = 0;
+	uint32 dxt = 0;
+	bool alpha = header[20] & 0x1;
+	if (size < 128 || header[0] != 0x20534444 || header[1] != 124 ||
+	    header[28] & 0x200200) {
+		// cube maps and volumes can't be stored in a TXD
+	} else if (header[20] & 0x4) {
+		char fourcc[5];
+		memcpy(fourcc, &header[21], 4);
+		fourcc[4] = 0;
+		if (strcmp(fourcc, "DXT1") == 0) {
+			format = alpha ? RASTER_1555 : RASTER_565;
+			dxt = 1;
+		} else if (strcmp(fourcc, "DXT3") == 0) {
+			format = RASTER_4444;
+			dxt = 3;
+		} else if (strcmp(fourcc, "DXT5") == 0) {
+			format = RASTER_4444;
+			dxt = 5;
+		} else if (strcmp(fourcc, "DX10") == 0 &&
+		           header[33] == 3 && (header[34] & 0x4) == 0 &&
+		           header[35] <= 1) {
+			offset = 148;
+			for (uint32 i = 0; i < sizeof(dxgiFormats)/
+			                       sizeof(dxgiFormats[0]); i++)
+				if (dxgiFormats[i].dxgi == header[32]) {
+					format = dxgiFormats[i].rasterFormat;
+					dxt = dxgiFormats[i].dxt;
+				}
+			alpha = getRasterFormatInfo(format)->bits[3] != 0;
+		}
+	} else if (header[20] & 0x20000) {
+		if (header[22] == 8 && header[23] == 0xFF)
+			format = RASTER_LUM8;
+	} else if (header[20] & 0x40) {
+		for (uint32 f = RASTER_1555; f <= RASTER_555; f += 0x100) {
+			const RasterFormatInfo *info = getRasterFormatInfo(f);
+			if (info->depth != header[22] || info->bits[0] == 0 ||
+			    (info->bits[3] != 0) != alpha)
+				continue;
+			bool match = true;
+			for (uint32 i = 0; i < 4; i++) {
+				uint32 mask = ((1 << info->bits[i]) - 1) <<
+				              info->shift[i];
+				if (i < 3 || alpha)
+					match &= mask == header[23+i];
+			}
+			if (match)
+				format = f;
+		}
+	}
+	if (format == 0) {
+		cerr << "unsupported DDS: " << path << endl;
+		delete[] data;
+		return false;
+	}
+
+	uint32 w = header[4], h = header[3];
+	if (w == 0 || h == 0 || w > IMAGE_MAX_DIM || h > IMAGE_MAX_DIM) {
+		cerr << "unsupported DDS size: " << path << endl;
+		delete[] data;
+		return false;
+	}
+	// ignore levels below 1x1, that also keeps the count within 8 bits
+	uint32 maxLevels = 1;
+	for (uint32 d = max(w, h); d > 1; d /= 2)
+		maxLevels++;
+	uint32 levels = header[2] & 0x20000 ? max(1u, header[7]) : 1;
+	levels = min(levels, maxLevels);
+	uint32 depth = dxt ? 16 : getRasterFormatInfo(format)->depth;
+	if (offset + imageSize(w, h, levels, depth, dxt) > size) {
+		cerr << "truncated DDS: " << path << endl;
+		delete[] data;
+		return false;
+	}
+	initImage(*this, path, w, h, levels, depth, format, dxt);
+	hasAlpha = dxt == 3 || dxt == 5 || alpha;
+	for (uint32 i = 0; i < levels; i++) {
+		memcpy(texels[i], &data[offset], dataSizes[i]);
+		offset += dataSizes[i];
+	}
+	delete[] data;
+	return true;
+}
+
+/* RLE packets don't cross rows */
+static uint32 encodeTgaRle(uint8 *out, const uint32 *row, uint32 width)
+{
+	uint32 n = 0;
+	uint32 x = 0;
+	while (x < width) {
+		uint32 run = 1;
+		while (x+run < width && run < 128 && row[x+run] == row[x])
+			run++;
+		if (run > 1) {
+			out[n++] = 0x80 | (run-1);
+			memcpy(&out[n], &row[x], 4);
+			n += 4;
+			x += run;
+			continue;
+		}
+		// raw packet until the next run of at least two
+		uint32 raw = 1;
+		while (x+raw < width && raw < 128 &&
+		       !(x+raw+1 < width && row[x+raw] == row[x+raw+1]))
+			raw++;
+		out[n++] = raw-1;
+		memcpy(&out[n], &row[x], raw*4);
+		n += raw*4;
+		x += raw;
+	}
+	return n;
+}
+
+/* writes the first mipmap as a 32 bit TGA in a single write */
+bool NativeTexture::writeTGA(const string &path, bool rle)
+{
+	if (depth != 32 || texels.empty() || texels[0] == 0) {
+		cerr << "not writing file: " << path << endl;
+		return false;
+	}
+	uint32 w = width[0], h = height[0];
+	// RLE is at most one byte per pixel larger
+	uint32 size = 18 + (rle ? w*h*5 : w*h*4);
+	uint8 *out = new uint8[size];
+	memset(out, 0, 18);
+	out[2] = rle ? 10 : 2;
+	out[12] = w & 0xFF;
+	out[13] = w >> 8;
+	out[14] = h & 0xFF;
+	out[15] = h >> 8;
+	out[16] = 0x20;
+	out[17] = 0x28;	// 8 alpha bits, top-left origin
+	uint32 n = 18;
+	if (rle)
+		for (uint32 y = 0; y < h; y++)
+			n += encodeTgaRle(&out[n],
+			                  (uint32 *) &texels[0][y*w*4], w);
+	else {
+		memcpy(&out[n], texels[0], w*h*4);
+		n += w*h*4;
+	}
+
+	ofstream tga(path.c_str(), ios::binary);
+	tga.write(reinterpret_cast <char *> (out), n);
+	delete[] out;
 	if (tga.fail()) {
-		cout << "not writing file: " << filename << endl;
-		return;
+		cerr << "not writing file: " << path << endl;
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Writes all mipmaps as DDS. DXT blocks and the D3D pixel formats are
+ * copied as they are; paletted, PS2 and Xbox swizzled textures have to
+ * be converted first. All formats map to legacy DDS pixel formats,
+ * so no DX10 header is needed.
+ */
+bool NativeTexture::writeDDS(const string &path)
+{
+	bool paletted = rasterFormat & (RASTER_PAL8 | RASTER_PAL4);
+	const RasterFormatInfo *info = getRasterFormatInfo(rasterFormat);
+	bool d3d = platform == PLATFORM_D3D8 || platform == PLATFORM_D3D9;
+	if (!d3d || paletted || texels.empty() || texels[0] == 0 ||
+	    (!dxtCompression && (info->depth == 0 || info->depth != depth))) {
+		cerr << "not writing file: " << path << endl;
+		return false;
+	}
+
+	// non-square textures may have empty levels at the end
+	uint32 levels = 0;
+	uint32 size = 128;
+	while (levels < texels.size() && dataSizes[levels] != 0 &&
+	       width[levels] != 0 && height[levels] != 0)
+		size += dataSizes[levels++];
+
+	uint32 header[32];
+	memset(header, 0, sizeof(header));
+	header[0] = 0x20534444;		// "DDS "
+	header[1] = 124;
+	header[2] = 0x1007;		// caps, height, width, pixel format
+	header[3] = height[0];
+	header[4] = width[0];
+	header[7] = levels;
+	header[19] = 32;
+	header[27] = 0x1000;		// texture
+	if (levels > 1) {
+		header[2] |= 0x20000;
+		header[27] |= 0x400008;	// complex, mipmap
 	}
-	writeUInt8(0, tga);
-	writeUInt8(0, tga);
-	writeUInt8(2, tga);
-	writeUInt16(0, tga);
-	writeUInt16(0, tga);
-	writeUInt8(0, tga);
-	writeUInt16(0, tga);
-	writeUInt16(0, tga);
-	writeUInt16(width[0], tga);
-	writeUInt16(height[0], tga);
-	writeUInt8(0x20, tga);
-	writeUInt8(0x28, tga);
-	for (uint32 j = 0; j < width[0]*height[0]; j++){
-		writeUInt8(texels[0][j*4+0], tga);
-		writeUInt8(texels[0][j*4+1], tga);
-		writeUInt8(texels[0][j*4+2], tga);
-		writeUInt8(texels[0][j*4+3], tga);
-	}
-	tga.close();
+	if (dxtCompression) {
+		header[2] |= 0x80000;	// linear size
+		header[5] = dataSizes[0];
+		header[20] = 0x4;	// fourcc
+		// the Xbox's DXT4 has the same layout as DXT5
+		char fourcc[5] = "DXT0";
+		fourcc[3] += dxtCompression == 4 ? 5 : dxtCompression;
+		memcpy(&header[21], fourcc, 4);
+	} else {
+		header[2] |= 0x8;	// pitch
+		header[5] = width[0]*depth/8;
+		header[22] = depth;
+		uint32 mask[4];
+		for (uint32 i = 0; i < 4; i++)
+			mask[i] = ((1 << info->bits[i]) - 1) << info->shift[i];
+		if ((rasterFormat & RASTER_MASK) == RASTER_LUM8) {
+			header[20] = 0x20000;	// luminance
+			header[23] = mask[0];
+		} else {
+			header[20] = 0x40;	// rgb
+			header[23] = mask[0];
+			header[24] = mask[1];
+			header[25] = mask[2];
+		}
+		if (info->bits[3]) {
+			header[20] |= 0x1;	// alpha pixels
+			header[26] = mask[3];
+		}
+	}
+
+	uint8 *out = new uint8[size];
+	memcpy(out, header, 128);
+	uint32 n = 128;
+	for (uint32 i = 0; i < levels; i++) {
+		memcpy(&out[n], texels[i], dataSizes[i]);
+		n += dataSizes[i];
+	}
+
+	ofstream dds(path.c_str(), ios::binary);
+	dds.write(reinterpret_cast <char *> (out), n);
+	delete[] out;
+	if (dds.fail()) {
+		cerr << "not writing file: " << path << endl;
+		return false;
+	}
+	return true;
 }
 
 NativeTexture::NativeTexture(void)
 : platform(0), name(""), maskName(""), filterFlags(0), rasterFormat(0),
-  depth(0), palette(0), paletteSize(0), hasAlpha(false), mipmapCount(0),
+  depth(0), palette(0), paletteSize(0), paletteOffset(0), buffer(0),
+  bufferSize(0), hasAlpha(false), mipmapCount(0),
   alphaDistribution(0), dxtCompression(0)
 {
 }
@@ -896,7 +1697,13 @@ NativeTexture::NativeTexture(const NativeTexture &orig)
   height(orig.height),
   depth(orig.depth),
   dataSizes(orig.dataSizes),
+  texels(orig.texels.size(), 0),
+  dataOffsets(orig.dataOffsets),
+  palette(0),
   paletteSize(orig.paletteSize),
+  paletteOffset(orig.paletteOffset),
+  buffer(0),
+  bufferSize(orig.bufferSize),
   hasAlpha(orig.hasAlpha),
   mipmapCount(orig.mipmapCount),
   swizzleWidth(orig.swizzleWidth),
@@ -904,98 +1711,73 @@ NativeTexture::NativeTexture(const NativeTexture &orig)
   alphaDistribution(orig.alphaDistribution),
   dxtCompression(orig.dxtCompression)
 {
-	if (orig.palette) {
-		palette = new uint8[paletteSize*4*sizeof(uint8)];
-		memcpy(palette, orig.palette, paletteSize*4*sizeof(uint8));
-	} else {
-		palette = 0;
-	}
-
-	for (uint32 i = 0; i < orig.texels.size(); i++) {
-		uint32 dataSize = dataSizes[i];
-		uint8 *newtexels = new uint8[dataSize];
-		memcpy(newtexels, &orig.texels[i][0], dataSize);
-		texels.push_back(newtexels);
-	}
+	if (orig.buffer == 0)
+		return;
+	// same layout, so the pointers only have to be rebased
+	buffer = new uint8[bufferSize];
+	memcpy(buffer, orig.buffer, bufferSize);
+	if (orig.palette)
+		palette = buffer + (orig.palette - orig.buffer);
+	for (uint32 i = 0; i < texels.size(); i++)
+		if (orig.texels[i])
+			texels[i] = buffer + (orig.texels[i] - orig.buffer);
 }
 
 NativeTexture &NativeTexture::operator=(const NativeTexture &that)
 {
 	if (this != &that) {
-		platform = that.platform;
-		name = that.name;
-		maskName = that.maskName;
-		filterFlags = that.filterFlags;
-		rasterFormat = that.rasterFormat;
-		width = that.width;
-		height = that.height;
-		depth = that.depth;
-		dataSizes = that.dataSizes;
-
-		paletteSize = that.paletteSize;
-		hasAlpha = that.hasAlpha;
-		mipmapCount = that.mipmapCount;
-		swizzleWidth = that.swizzleWidth;
-		swizzleHeight = that.swizzleHeight;
-		dxtCompression = that.dxtCompression;
-
-
-		delete[] palette;
-		palette = 0;
-		if (that.palette) {
-			palette = new uint8[that.paletteSize*4];
-			memcpy(&palette[0], &that.palette[0],
-			       that.paletteSize*4*sizeof(uint8));
-		}
-
-		for (uint32 i = 0; i < texels.size(); i++) {
-			delete[] texels[i];
-			texels[i] = 0;
-			if (that.texels[i]) {
-				texels[i] = new uint8[that.dataSizes[i]];
-				memcpy(&texels[i][0], &that.texels[i][0],
-				       that.dataSizes[i]*sizeof(uint8));
-			}
-		}
+		NativeTexture tmp(that);
+		swap(tmp);
 	}
 	return *this;
 }
 
-NativeTexture::~NativeTexture(void)
+#if __cplusplus >= 201103L
+NativeTexture::NativeTexture(NativeTexture &&orig) noexcept
+: platform(0), filterFlags(0), rasterFormat(0),
+  depth(0), palette(0), paletteSize(0), paletteOffset(0), buffer(0),
+  bufferSize(0), hasAlpha(false), mipmapCount(0),
+  alphaDistribution(0), dxtCompression(0)
 {
-	delete[] palette;
-	palette = 0;
-	for (uint32 i = 0; i < texels.size(); i++) {
-		delete[] texels[i];
-		texels[i] = 0;
-	}
+	swap(orig);
 }
 
+NativeTexture &NativeTexture::operator=(NativeTexture &&that) noexcept
+{
+	swap(that);
+	return *this;
+}
+#endif
 
-
-/* convert from CLUT format used by the ps2 */
-static void unclut(uint8 *texels, uint32 width, uint32 height)
+void NativeTexture::swap(NativeTexture &that)
 {
-	uint8 map[4] = { 0, 16, 8, 24 };
-	for (uint32 i = 0; i < width*height; i++)
-		texels[i] = (texels[i] & ~0x18) | map[(texels[i] & 0x18) >> 3];
+	std::swap(platform, that.platform);
+	name.swap(that.name);
+	maskName.swap(that.maskName);
+	std::swap(filterFlags, that.filterFlags);
+	std::swap(rasterFormat, that.rasterFormat);
+	width.swap(that.width);
+	height.swap(that.height);
+	std::swap(depth, that.depth);
+	dataSizes.swap(that.dataSizes);
+	texels.swap(that.texels);
+	dataOffsets.swap(that.dataOffsets);
+	std::swap(palette, that.palette);
+	std::swap(paletteSize, that.paletteSize);
+	std::swap(paletteOffset, that.paletteOffset);
+	std::swap(buffer, that.buffer);
+	std::swap(bufferSize, that.bufferSize);
+	std::swap(hasAlpha, that.hasAlpha);
+	std::swap(mipmapCount, that.mipmapCount);
+	swizzleWidth.swap(that.swizzleWidth);
+	swizzleHeight.swap(that.swizzleHeight);
+	std::swap(alphaDistribution, that.alphaDistribution);
+	std::swap(dxtCompression, that.dxtCompression);
 }
 
-/* taken from the ps2 linux website */
-static void unswizzle8(uint8 *texels, uint8 *rawIndices,
-                       uint32 width, uint32 height)
+NativeTexture::~NativeTexture(void)
 {
-	for (uint32 y = 0; y < height; y++)
-		for (uint32 x = 0; x < width; x++) {
-			int32 block_loc = (y&(~0x0F))*width + (x&(~0x0F))*2;
-			uint32 swap_sel = (((y+2)>>2)&0x01)*4;
-			int32 ypos = (((y&(~3))>>1) + (y&1))&0x07;
-			int32 column_loc = ypos*width*2 + ((x+swap_sel)&0x07)*4;
-			int32 byte_sum = ((y>>1)&1) + ((x>>2)&2);
-			uint32 swizzled = block_loc + column_loc + byte_sum;
-//			cout << swizzled << endl;
-			texels[y*width+x] = rawIndices[swizzled];
-		}
+	delete[] buffer;
 }
 
 }
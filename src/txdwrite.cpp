@@ -22,52 +22,92 @@ namespace rw {
 	rw.seekp(oldPos, ios::beg);
 
 uint32 TextureDictionary::write(ostream &rw)
+{
+	TextureDictionaryWriter writer;
+	writer.begin(rw);
+	for (uint32 i = 0; i < texList.size(); i++)
+		writer.write(texList[i]);
+	return writer.end();
+}
+
+/*
+ * The texture count and the dictionary's size are patched in by end(),
+ * so textures can be written as soon as they are converted.
+ */
+
+void TextureDictionaryWriter::begin(ostream &txd)
 {
 	HeaderInfo header;
 	header.build = version;
-	uint32 writtenBytesReturn;
-
-	/*
-	 * writtenBytesReturn will always contain the number of bytes
-	 * written in a sub-block, it is used like a return value.
-	 */
 
-	// Texture Dictionary
-	SKIP_HEADER();
+	rw = &txd;
+	headerPos = txd.tellp();
+	txd.seekp(0x0C, ios::cur);
 
 	// Struct
-	{
-		SKIP_HEADER();
-		bytesWritten += writeUInt16(texList.size(), rw);
-		// TODO, wtf is that?
-		bytesWritten += writeUInt16(0, rw);
-		WRITE_HEADER(CHUNK_STRUCT);
-	}
-	bytesWritten += writtenBytesReturn;
+	header.type = CHUNK_STRUCT;
+	header.length = 4;
+	bytesWritten = header.write(txd);
+	countPos = txd.tellp();
+	bytesWritten += writeUInt16(0, txd);
+	// TODO, wtf is that?
+	bytesWritten += writeUInt16(0, txd);
+	textureCount = 0;
+}
 
-	// Texture Natives
-	for (uint32 i = 0; i < texList.size(); i++) {
-		if (texList[i].platform == PLATFORM_D3D8 ||
-		    texList[i].platform == PLATFORM_D3D9) {
-			bytesWritten += texList[i].writeD3d(rw);
-		} else {
-			cerr << "can't write platform " <<
-				texList[i].platform << endl;
-		}
+void TextureDictionaryWriter::write(NativeTexture &tex)
+{
+	if (tex.platform == PLATFORM_D3D8 ||
+	    tex.platform == PLATFORM_D3D9) {
+		bytesWritten += tex.writeD3d(*rw);
+		textureCount++;
+	} else if (tex.platform == PLATFORM_XBOX) {
+		uint32 n = tex.writeXbox(*rw);
+		bytesWritten += n;
+		if (n)
+			textureCount++;
+	} else if (tex.platform == PLATFORM_PS2) {
+		uint32 n = tex.writePs2(*rw);
+		bytesWritten += n;
+		if (n)
+			textureCount++;
+	} else {
+		cerr << "can't write platform " << tex.platform << endl;
 	}
+}
+
+uint32 TextureDictionaryWriter::end(void)
+{
+	HeaderInfo header;
+	header.build = version;
 
 	// Extension
-	{
-		SKIP_HEADER();
-		WRITE_HEADER(CHUNK_EXTENSION);
-	}
-	bytesWritten += writtenBytesReturn;
+	header.type = CHUNK_EXTENSION;
+	header.length = 0;
+	bytesWritten += header.write(*rw);
 
-	WRITE_HEADER(CHUNK_TEXDICTIONARY);
+	uint32 oldPos = rw->tellp();
+	rw->seekp(countPos, ios::beg);
+	writeUInt16(textureCount, *rw);
+	rw->seekp(headerPos, ios::beg);
+	header.type = CHUNK_TEXDICTIONARY;
+	header.length = bytesWritten;
+	bytesWritten += header.write(*rw);
+	rw->seekp(oldPos, ios::beg);
 
 	return bytesWritten;
 }
 
+/* names are 32 bytes, zero padded and always terminated */
+static uint32 writeName(ostream &rw, const string &name)
+{
+	char buffer[32];
+	memset(buffer, 0, sizeof(buffer));
+	strncpy(buffer, name.c_str(), sizeof(buffer)-1);
+	rw.write(buffer, sizeof(buffer));
+	return sizeof(buffer);
+}
+
 uint32 NativeTexture::writeD3d(ostream &rw)
 {
 	HeaderInfo header;
@@ -87,12 +127,8 @@ uint32 NativeTexture::writeD3d(ostream &rw)
 		bytesWritten += writeUInt32(platform, rw);
 		bytesWritten += writeUInt32(filterFlags, rw);
 
-		char buffer[32];
-		strncpy(buffer, name.c_str(), 32);
-		rw.write(buffer, 32);
-		strncpy(buffer, maskName.c_str(), 32);
-		rw.write(buffer, 32);
-		bytesWritten += 2*32;
+		bytesWritten += writeName(rw, name);
+		bytesWritten += writeName(rw, maskName);
 
 		bytesWritten += writeUInt32(rasterFormat, rw);
 /*
@@ -108,9 +144,21 @@ if(rasterFormat == RASTER_8888 && !hasAlpha ||
 				fourcc[3] += dxtCompression;
 				rw.write(fourcc, 4);
 				bytesWritten += 4;
+			} else if (rasterFormat & (RASTER_PAL8 | RASTER_PAL4)) {
+				// D3DFMT_P8
+				bytesWritten += writeUInt32(0x29, rw);
 			} else {
-				// 0x15 or 0x16
-				bytesWritten += writeUInt32(0x16-hasAlpha, rw);
+				// D3DFORMAT of the raster
+				uint32 d3dFormat;
+				switch (rasterFormat & RASTER_MASK) {
+				case RASTER_565: d3dFormat = 0x17; break;
+				case RASTER_1555: d3dFormat = 0x19; break;
+				case RASTER_4444: d3dFormat = 0x1a; break;
+				case RASTER_555: d3dFormat = 0x18; break;
+				case RASTER_LUM8: d3dFormat = 0x32; break;
+				default: d3dFormat = 0x16-hasAlpha; break;
+				}
+				bytesWritten += writeUInt32(d3dFormat, rw);
 			}
 		}
 		bytesWritten += writeUInt16(width[0], rw);
@@ -165,4 +213,365 @@ if(rasterFormat == RASTER_8888 && !hasAlpha ||
 	return bytesWritten;
 }
 
+/*
+ * Xbox
+ */
+
+/* Uncompressed mipmaps are swizzled, DXT is written as is.
+ * The Xbox only has 8 bit palettes, so PAL4 is written as PAL8. */
+uint32 NativeTexture::writeXbox(ostream &rw)
+{
+	HeaderInfo header;
+	header.build = version;
+	uint32 writtenBytesReturn;
+
+	if (platform != PLATFORM_XBOX)
+		return 0;
+
+	uint32 xboxDxt = 0;
+	if (dxtCompression == 1)
+		xboxDxt = 0xC;
+	else if (dxtCompression == 3)
+		xboxDxt = 0xE;
+	else if (dxtCompression == 4 || dxtCompression == 5)
+		xboxDxt = 0xF;
+	bool paletted = rasterFormat & (RASTER_PAL4 | RASTER_PAL8);
+	if ((dxtCompression && xboxDxt == 0) ||
+	    (!dxtCompression && !paletted &&
+	     depth != 0x10 && depth != 0x20)) {
+		cerr << "can't write " << name << " for Xbox, format " <<
+			hex << rasterFormat << dec << endl;
+		return 0;
+	}
+	uint32 xboxDepth = paletted ? 8 : depth;
+	uint32 xboxFormat = rasterFormat;
+	if (rasterFormat & RASTER_PAL4)
+		xboxFormat = (rasterFormat & ~RASTER_PAL4) | RASTER_PAL8;
+
+	/* readXbox computes the level sizes from the dimensions,
+	 * write exactly that much */
+	vector<uint32> levelSizes(mipmapCount);
+	uint32 dataSize = 0;
+	for (uint32 i = 0; i < mipmapCount; i++) {
+		levelSizes[i] = width[i]*height[i];
+		if (dxtCompression == 0)
+			levelSizes[i] *= xboxDepth/8;
+		else if (xboxDxt == 0xC)
+			levelSizes[i] /= 2;
+		if (dataSizes[i] < levelSizes[i]) {
+			cerr << "can't write " << name << " for Xbox, " <<
+			        "level " << i << " is too short\n";
+			return 0;
+		}
+		dataSize += levelSizes[i];
+	}
+
+	// Texture Native
+	SKIP_HEADER();
+
+	// Struct
+	{
+		SKIP_HEADER();
+		bytesWritten += writeUInt32(PLATFORM_XBOX, rw);
+		bytesWritten += writeUInt32(filterFlags, rw);
+
+		bytesWritten += writeName(rw, name);
+		bytesWritten += writeName(rw, maskName);
+
+		bytesWritten += writeUInt32(xboxFormat, rw);
+		bytesWritten += writeUInt32(hasAlpha, rw);
+		bytesWritten += writeUInt16(width[0], rw);
+		bytesWritten += writeUInt16(height[0], rw);
+		bytesWritten += writeUInt8(xboxDepth, rw);
+		bytesWritten += writeUInt8(mipmapCount, rw);
+		bytesWritten += writeUInt8(0x4, rw);
+		bytesWritten += writeUInt8(xboxDxt, rw);
+		bytesWritten += writeUInt32(dataSize, rw);
+
+		/* Palette */
+		if (paletted) {
+			uint8 xboxPalette[0x100*4];
+			memset(xboxPalette, 0, sizeof(xboxPalette));
+			memcpy(xboxPalette, palette,
+			       (paletteSize < 0x100 ? paletteSize : 0x100)*4);
+			rw.write(reinterpret_cast <char *> (xboxPalette),
+			         sizeof(xboxPalette));
+			bytesWritten += sizeof(xboxPalette);
+		}
+
+		/* Texels */
+		uint8 *swizzled = 0;
+		if (!dxtCompression && mipmapCount > 0)
+			swizzled = new uint8[levelSizes[0]];
+		for (uint32 i = 0; i < mipmapCount; i++) {
+			uint8 *data = texels[i];
+			if (swizzled && swizzleXbox(swizzled, texels[i],
+			    width[i], height[i], xboxDepth))
+				data = swizzled;
+			rw.write(reinterpret_cast <char *> (data),
+			         levelSizes[i]*sizeof(uint8));
+			bytesWritten += levelSizes[i]*sizeof(uint8);
+		}
+		delete[] swizzled;
+
+		WRITE_HEADER(CHUNK_STRUCT);
+	}
+	bytesWritten += writtenBytesReturn;
+
+	// Extension
+	{
+		SKIP_HEADER();
+		WRITE_HEADER(CHUNK_EXTENSION);
+	}
+	bytesWritten += writtenBytesReturn;
+
+	WRITE_HEADER(CHUNK_TEXTURENATIVE);
+
+	return bytesWritten;
+}
+
+/*
+ * PS2
+ */
+
+/* GIF packet that uploads a width*height PSMCT32 image (qwc quadwords),
+ * readPs2 takes the sizes from it */
+static uint32 writeGsUpload(ostream &rw, uint32 width, uint32 height,
+                            uint32 qwc)
+{
+	uint32 p[20];
+	memset(p, 0, sizeof(p));
+	p[0] = 3;		// NLOOP
+	p[1] = 0x10000000;	// NREG = 1
+	p[2] = 0xE;		// A+D
+	p[6] = 0x51;		// TRXPOS
+	p[8] = width;
+	p[9] = height;
+	p[10] = 0x52;		// TRXREG
+	p[14] = 0x53;		// TRXDIR
+	p[16] = qwc;
+	p[17] = 0x08000000;	// IMAGE
+	rw.write(reinterpret_cast <char *> (p), sizeof(p));
+	return sizeof(p);
+}
+
+static uint32 log2Ceil(uint32 n)
+{
+	uint32 i = 0;
+	while ((1U << i) < n)
+		i++;
+	return i;
+}
+
+/* Only the first mipmap is written. Paletted textures are swizzled
+ * to PSMT8 order when they're at least 16x4 (the inverse of
+ * convertFromPS2), 16 and 32 bit textures stay linear. */
+uint32 NativeTexture::writePs2(ostream &rw)
+{
+	HeaderInfo header;
+	header.build = version;
+	uint32 writtenBytesReturn;
+
+	if (platform != PLATFORM_PS2)
+		return 0;
+
+	uint32 w = width[0];
+	uint32 h = height[0];
+	bool paletted = rasterFormat & (RASTER_PAL4 | RASTER_PAL8);
+	uint32 ps2Depth = (rasterFormat & RASTER_PAL4) ? 4 :
+	                  (rasterFormat & RASTER_PAL8) ? 8 : depth;
+	uint32 format = rasterFormat & RASTER_MASK;
+	if (dxtCompression || (paletted && dataSizes[0] < w*h) ||
+	    (!paletted && !(depth == 0x20 &&
+	                    (format == RASTER_8888 || format == RASTER_888)) &&
+	     !(depth == 0x10 && format == RASTER_1555))) {
+		cerr << "can't write " << name << " for PS2, format " <<
+			hex << rasterFormat << dec << endl;
+		return 0;
+	}
+
+	// texels, padded to a whole quadword
+	bool swizzled = paletted && w >= 16 && h >= 4;
+	uint32 swizzleW = w, swizzleH = h;
+	if (swizzled) {
+		swizzleW = w/2;
+		swizzleH = (ps2Depth == 4) ? h/4 : h/2;
+	}
+	uint32 texelSize = (w*h*ps2Depth/8 + 15) & ~15;
+	uint8 *data = new uint8[texelSize];
+	memset(data, 0, texelSize);
+	if (paletted) {
+		swizzlePs2(data, texels[0], w, h, w, ps2Depth, swizzled);
+	} else if (depth == 0x20) {
+		for (uint32 i = 0; i < w*h; i++) {
+			data[i*4+0] = texels[0][i*4+2];
+			data[i*4+1] = texels[0][i*4+1];
+			data[i*4+2] = texels[0][i*4+0];
+			data[i*4+3] = (format == RASTER_888) ? 0x80 :
+				(texels[0][i*4+3]*0x80 + 0x7F) / 0xFF;
+		}
+	} else {
+		uint16 *in = (uint16 *) texels[0];
+		uint16 *out = (uint16 *) data;
+		for (uint32 i = 0; i < w*h; i++)
+			out[i] = (in[i] & 0x83E0) |
+			         (in[i] & 0x001F) << 10 |
+			         (in[i] & 0x7C00) >> 10;
+	}
+
+	// 16x16 for PSMT8, 8x2 for PSMT4
+	uint32 paletteW = 0, paletteH = 0;
+	uint8 ps2Palette[0x100*4];
+	if (paletted) {
+		paletteW = (ps2Depth == 4) ? 8 : 16;
+		paletteH = (ps2Depth == 4) ? 2 : 16;
+		memset(ps2Palette, 0, sizeof(ps2Palette));
+		uint32 n = paletteW*paletteH;
+		if (n > paletteSize)
+			n = paletteSize;
+		for (uint32 i = 0; i < n; i++) {
+			ps2Palette[i*4+0] = palette[i*4+0];
+			ps2Palette[i*4+1] = palette[i*4+1];
+			ps2Palette[i*4+2] = palette[i*4+2];
+			ps2Palette[i*4+3] = (palette[i*4+3]*0x80 + 0x7F) / 0xFF;
+		}
+	}
+	uint32 paletteBytes = paletteW*paletteH*4;
+
+	// Texture Native
+	SKIP_HEADER();
+
+	// Struct
+	{
+		SKIP_HEADER();
+		bytesWritten += writeUInt32(PLATFORM_PS2FOURCC, rw);
+		bytesWritten += writeUInt32(filterFlags, rw);
+		WRITE_HEADER(CHUNK_STRUCT);
+	}
+	bytesWritten += writtenBytesReturn;
+
+	// String -- Texture name
+	{
+		SKIP_HEADER();
+		uint32 len = name.length()+1;
+		rw.write(name.c_str(), len);
+		bytesWritten += len;
+		if (len % 4 != 0) {
+			rw.seekp(4 - len % 4, ios::cur);
+			bytesWritten += 4 - len % 4;
+		}
+		WRITE_HEADER(CHUNK_STRING);
+	}
+	bytesWritten += writtenBytesReturn;
+
+	// String -- Mask name
+	{
+		SKIP_HEADER();
+		uint32 len = maskName.length()+1;
+		rw.write(maskName.c_str(), len);
+		bytesWritten += len;
+		if (len % 4 != 0) {
+			rw.seekp(4 - len % 4, ios::cur);
+			bytesWritten += 4 - len % 4;
+		}
+		WRITE_HEADER(CHUNK_STRING);
+	}
+	bytesWritten += writtenBytesReturn;
+
+	// Struct -- Raster
+	{
+		SKIP_HEADER();
+
+		// Struct -- Raster header
+		{
+			SKIP_HEADER();
+			uint32 psm = (ps2Depth == 4) ? 0x14 :
+			             (ps2Depth == 8) ? 0x13 :
+			             (ps2Depth == 16) ? 0x02 : 0x00;
+			uint32 bufferWidth = (w+63)/64;
+			if (ps2Depth <= 8)
+				bufferWidth = (bufferWidth+1) & ~1;
+			uint32 blocks = (texelSize+255)/256;
+			uint64 tex0 = (uint64) bufferWidth << 14 |
+			              (uint64) psm << 20 |
+			              (uint64) log2Ceil(w) << 26 |
+			              (uint64) log2Ceil(h) << 30 |
+			              (uint64) hasAlpha << 34;
+			if (paletted)
+				tex0 |= (uint64) blocks << 37 |	// CBP
+				        (uint64) 1 << 61;	// CLD
+			uint32 filter = filterFlags & 0xFF;
+			uint32 linear = (filter == 1 || filter == 3 ||
+			                 filter == 5) ? 0 : 1;
+			uint32 tex1 = linear << 5 | linear << 6;
+
+			uint32 ps2Format = rasterFormat &
+				~(RASTER_MIPMAP | RASTER_AUTOMIPMAP);
+			ps2Format = (ps2Format & 0xFF00) | 0x20000 | 4;
+
+			bytesWritten += writeUInt32(w, rw);
+			bytesWritten += writeUInt32(h, rw);
+			bytesWritten += writeUInt32(ps2Depth, rw);
+			bytesWritten += writeUInt32(ps2Format, rw);
+			bytesWritten += writeUInt32(tex0, rw);
+			bytesWritten += writeUInt32(tex0 >> 32, rw);
+			bytesWritten += writeUInt32(tex1, rw);
+			bytesWritten += writeUInt32(0, rw);
+			// MIPTBP1, MIPTBP2
+			for (uint32 i = 0; i < 4; i++)
+				bytesWritten += writeUInt32(0, rw);
+			bytesWritten += writeUInt32(texelSize + 0x50, rw);
+			bytesWritten += writeUInt32(paletted ?
+				paletteBytes + 0x50 : 0, rw);
+			bytesWritten += writeUInt32(blocks*256 +
+				(paletteBytes+255)/256*256, rw);
+			bytesWritten += writeUInt32(0xFC0, rw);
+			WRITE_HEADER(CHUNK_STRUCT);
+		}
+		bytesWritten += writtenBytesReturn;
+
+		// Struct -- Texels and palette
+		{
+			SKIP_HEADER();
+			bytesWritten += writeGsUpload(rw, swizzleW, swizzleH,
+			                              texelSize/0x10);
+			rw.write(reinterpret_cast <char *> (data), texelSize);
+			bytesWritten += texelSize;
+			if (paletted) {
+				bytesWritten += writeGsUpload(rw, paletteW,
+					paletteH, paletteBytes/0x10);
+				rw.write(reinterpret_cast <char *> (ps2Palette),
+				         paletteBytes);
+				bytesWritten += paletteBytes;
+			}
+			WRITE_HEADER(CHUNK_STRUCT);
+		}
+		bytesWritten += writtenBytesReturn;
+
+		WRITE_HEADER(CHUNK_STRUCT);
+	}
+	bytesWritten += writtenBytesReturn;
+	delete[] data;
+
+	// Extension
+	{
+		SKIP_HEADER();
+
+		// Sky Mipmap Val
+		{
+			SKIP_HEADER();
+			bytesWritten += writeUInt32(0xFC0, rw);
+			WRITE_HEADER(CHUNK_SKYMIPMAP);
+		}
+		bytesWritten += writtenBytesReturn;
+
+		WRITE_HEADER(CHUNK_EXTENSION);
+	}
+	bytesWritten += writtenBytesReturn;
+
+	WRITE_HEADER(CHUNK_TEXTURENATIVE);
+
+	return bytesWritten;
+}
+
 }
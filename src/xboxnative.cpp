@@ -1,12 +1,181 @@
 #include <renderware.h>
 
 #include <cstdio>
+#include <cmath>
 #include <cstdlib>
+#include <cstring>
+
+#ifdef __SSE2__
+  #include <emmintrin.h>
+  #include <xmmintrin.h>
+#endif
 
 using namespace std;
 
 namespace rw {
 
+/*
+ * The vertex stream is decoded from memory with a layout computed
+ * once from the flags and the vertex size.
+ */
+
+struct XboxLayout
+{
+	uint32 stride;
+	int32 position;
+	int32 compNormal;	// 11:11:10
+	int32 floatNormal;	// only vertex size 0x28
+	int32 color;		// BGRA
+	int32 texCoords[8];
+};
+
+/* known vertex sizes: 0x28, 0x20, 0x1c, 0x18, 0x14, 0x10, 0x0c */
+static void computeXboxLayout(XboxLayout &l, uint32 flags, uint32 numUVs,
+                              uint32 vertexSize)
+{
+	uint32 off = 0;
+	l.position = off;
+	off += 12;
+	l.compNormal = -1;
+	if (flags & FLAGS_NORMALS) {
+		l.compNormal = off;
+		off += 4;
+	}
+	l.color = -1;
+	if (flags & FLAGS_PRELIT) {
+		l.color = off;
+		off += 4;
+	}
+	for (uint32 i = 0; i < 8; i++)
+		l.texCoords[i] = -1;
+	if (flags & FLAGS_TEXTURED) {
+		l.texCoords[0] = off;
+		off += 8;
+	}
+	if (flags & FLAGS_TEXTURED2) {
+		// TODO: don't know if this is correct
+		for (uint32 i = 0; i < numUVs && i < 8; i++) {
+			l.texCoords[i] = off;
+			off += 8;
+		}
+	}
+	/* only vertex size 0x28 has 3*float normals,
+	 * they replace the compressed ones */
+	l.floatNormal = -1;
+	if (vertexSize == 0x28 && (flags & FLAGS_NORMALS)) {
+		l.floatNormal = off;
+		off += 12;
+	}
+	l.stride = vertexSize >= off ? vertexSize : off;
+}
+
+static void decodeCompNormals(float32 *dst, const uint8 *src, uint32 stride,
+                              uint32 n)
+{
+	uint32 i = 0;
+#ifdef __SSE2__
+	__m128 scale = _mm_setr_ps(0x3FF, 0x3FF, 0x1FF, 1.0f);
+	for (; i+4 <= n; i += 4) {
+		uint32 c[4];
+		for (uint32 k = 0; k < 4; k++)
+			memcpy(&c[k], &src[(i+k)*stride], 4);
+		__m128i v = _mm_setr_epi32(c[0], c[1], c[2], c[3]);
+		__m128 x = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_slli_epi32(v, 21), 21));
+		__m128 y = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_slli_epi32(v, 10), 21));
+		__m128 z = _mm_cvtepi32_ps(_mm_srai_epi32(v, 22));
+		__m128 w = _mm_setzero_ps();
+		_MM_TRANSPOSE4_PS(x, y, z, w);
+		__m128 r[4] = { x, y, z, w };
+		for (uint32 k = 0; k < 4; k++) {
+			__m128 f = _mm_div_ps(r[k], scale);
+			_mm_storel_pi((__m64 *) &dst[(i+k)*3], f);
+			_mm_store_ss(&dst[(i+k)*3+2], _mm_movehl_ps(f, f));
+		}
+	}
+#endif
+	for (; i < n; i++) {
+		uint32 c;
+		memcpy(&c, &src[i*stride], 4);
+		int32 normal[3];
+		normal[0] = c & 0x7FF;
+		normal[1] = (c & 0x3FF800) >> 11;
+		normal[2] = (c & 0xFFC00000) >> 22;
+		if (normal[0] & 0x400) normal[0] -= 0x800;
+		if (normal[1] & 0x400) normal[1] -= 0x800;
+		if (normal[2] & 0x200) normal[2] -= 0x400;
+		dst[i*3+0] = (float) normal[0] / 0x3FF;
+		dst[i*3+1] = (float) normal[1] / 0x3FF;
+		dst[i*3+2] = (float) normal[2] / 0x1FF;
+	}
+}
+
+static void decodeColors(uint8 *dst, const uint8 *src, uint32 stride,
+                         uint32 n)
+{
+	uint32 i = 0;
+#ifdef __SSE2__
+	__m128i ga = _mm_set1_epi32(0xFF00FF00);
+	__m128i low = _mm_set1_epi32(0xFF);
+	for (; i+4 <= n; i += 4) {
+		uint32 c[4];
+		for (uint32 k = 0; k < 4; k++)
+			memcpy(&c[k], &src[(i+k)*stride], 4);
+		__m128i v = _mm_setr_epi32(c[0], c[1], c[2], c[3]);
+		// swap blue and red
+		__m128i rb = _mm_or_si128(
+			_mm_and_si128(_mm_srli_epi32(v, 16), low),
+			_mm_slli_epi32(_mm_and_si128(v, low), 16));
+		_mm_storeu_si128((__m128i *) &dst[i*4],
+		                 _mm_or_si128(_mm_and_si128(v, ga), rb));
+	}
+#endif
+	for (; i < n; i++) {
+		const uint8 *color = &src[i*stride];
+		dst[i*4+0] = color[2];
+		dst[i*4+1] = color[1];
+		dst[i*4+2] = color[0];
+		dst[i*4+3] = color[3];
+	}
+}
+
+/* copies size bytes of every vertex */
+static void copyField(void *dst, const uint8 *src, uint32 stride,
+                      uint32 size, uint32 n)
+{
+	uint8 *d = (uint8 *) dst;
+	for (uint32 i = 0; i < n; i++)
+		memcpy(&d[i*size], &src[i*stride], size);
+}
+
+static void decodeXboxVertices(Geometry &g, const XboxLayout &l,
+                               const uint8 *data, uint32 n)
+{
+	uint32 base = g.vertices.size()/3;
+	g.vertices.resize((base+n)*3);
+	copyField(&g.vertices[base*3], data + l.position, l.stride, 12, n);
+	if (l.compNormal >= 0) {
+		g.normals.resize((base+n)*3);
+		if (l.floatNormal >= 0)
+			copyField(&g.normals[base*3], data + l.floatNormal,
+			          l.stride, 12, n);
+		else
+			decodeCompNormals(&g.normals[base*3],
+			                  data + l.compNormal, l.stride, n);
+	}
+	if (l.color >= 0) {
+		g.vertexColors.resize((base+n)*4);
+		decodeColors(&g.vertexColors[base*4], data + l.color,
+		             l.stride, n);
+	}
+	for (uint32 i = 0; i < 8; i++) {
+		if (l.texCoords[i] < 0)
+			continue;
+		g.texCoords[i].resize((base+n)*2);
+		copyField(&g.texCoords[i][base*2], data + l.texCoords[i],
+		          l.stride, 8, n);
+	}
+}
+
 void Geometry::readXboxNativeSkin(istream &rw)
 {
 	HeaderInfo header;
@@ -110,71 +279,236 @@ void Geometry::readXboxNativeData(istream &rw)
 	}
 
 	/* Indices */
+	vector<uint16> indices;
 	for (uint32 i = 0; i < splitCount; i++) {
 		/* skip padding */
 		uint32 pos = rw.tellg();
 		if ((pos - blockStart) % 0x10 != 0)
 			rw.seekg(0x10 - (pos - blockStart) % 0x10, ios::cur);
-		for (uint32 j = 0; j < splits[i].indices.size(); j++)
-			splits[i].indices[j] = readUInt16(rw);
+		uint32 n = splits[i].indices.size();
+		indices.resize(n);
+		if (n > 0)
+			rw.read((char *) &indices[0], n*sizeof(uint16));
+		for (uint32 j = 0; j < n; j++)
+			splits[i].indices[j] = indices[j];
 	}
 
 	/* Vertices */
 	rw.seekg(vertexPosition, ios::beg);
 
-	/* known vertex sizes: 0x28, 0x20, 0x1c, 0x18, 0x14, 0x10, 0x0c */
+	XboxLayout layout;
+	computeXboxLayout(layout, flags, numUVs, vertexSize);
+	if (layout.stride != vertexSize)
+		cerr << filename << ": vertex size " << vertexSize <<
+		        " doesn't match flags, using " << layout.stride << endl;
+
+	vector<uint8> data(vertexCount*layout.stride);
+	if (vertexCount > 0)
+		rw.read((char *) &data[0], data.size());
+	if ((uint32) rw.gcount() < data.size()) {
+		cerr << filename << ": vertex data too short\n";
+		memset(&data[rw.gcount()], 0, data.size() - rw.gcount());
+	}
+	if (vertexCount > 0)
+		decodeXboxVertices(*this, layout, &data[0], vertexCount);
+}
 
-	// only vertex size 0x28 has 3*float normals
-	bool compNormal = vertexSize != 0x28;
 
-	for (uint32 i = 0; i < vertexCount; i++) {
-		vertices.push_back(readFloat32(rw));
-		vertices.push_back(readFloat32(rw));
-		vertices.push_back(readFloat32(rw));
-
-		if (flags & FLAGS_NORMALS) {
-			uint32 compNormal = readUInt32(rw);
-			int32 normal[3];
-			normal[0] = compNormal & 0x7FF;
-			normal[1] = (compNormal & 0x3FF800) >> 11;
-			normal[2] = (compNormal & 0xFFC00000) >> 22;
-			if (normal[0] & 0x400) normal[0] -= 0x800;
-			if (normal[1] & 0x400) normal[1] -= 0x800;
-			if (normal[2] & 0x200) normal[2] -= 0x400;
-			normals.push_back((float) normal[0] / 0x3FF);
-			normals.push_back((float) normal[1] / 0x3FF);
-			normals.push_back((float) normal[2] / 0x1FF);
-		}
+/*
+ * Writing uses the same layout, vertex size 0 gives the packed one.
+ */
 
-		if (flags & FLAGS_PRELIT) {
-			uint8 color[4];
-			rw.read(reinterpret_cast <char *>
-				 (color), 4*sizeof(uint8));
-			vertexColors.push_back(color[2]);
-			vertexColors.push_back(color[1]);
-			vertexColors.push_back(color[0]);
-			vertexColors.push_back(color[3]);
-		}
+static uint32 packCompNormal(const float32 *n)
+{
+	static const int32 scale[3] = { 0x3FF, 0x3FF, 0x1FF };
+	int32 c[3];
+	for (uint32 i = 0; i < 3; i++) {
+		c[i] = (int32) floor(n[i]*scale[i] + 0.5f);
+		if (c[i] > scale[i]) c[i] = scale[i];
+		if (c[i] < -scale[i]) c[i] = -scale[i];
+	}
+	return (c[0] & 0x7FF) | (c[1] & 0x7FF) << 11 | (c[2] & 0x3FF) << 22;
+}
 
-		if (flags & FLAGS_TEXTURED) {
-			texCoords[0].push_back(readFloat32(rw));
-			texCoords[0].push_back(readFloat32(rw));
+static void encodeXboxVertices(uint8 *data, const XboxLayout &l,
+                               const Geometry &g, uint32 n)
+{
+	for (uint32 i = 0; i < n; i++) {
+		uint8 *v = &data[i*l.stride];
+		memcpy(v + l.position, &g.vertices[i*3], 12);
+		if (l.compNormal >= 0) {
+			uint32 c = packCompNormal(&g.normals[i*3]);
+			memcpy(v + l.compNormal, &c, 4);
 		}
+		if (l.color >= 0) {
+			const uint8 *color = &g.vertexColors[i*4];
+			v[l.color+0] = color[2];
+			v[l.color+1] = color[1];
+			v[l.color+2] = color[0];
+			v[l.color+3] = color[3];
+		}
+		for (uint32 j = 0; j < 8; j++)
+			if (l.texCoords[j] >= 0)
+				memcpy(v + l.texCoords[j],
+				       &g.texCoords[j][i*2], 8);
+	}
+}
 
-		if (flags & FLAGS_TEXTURED2) {
-			// TODO: don't know if this is correct
-			for (uint32 j = 0; j < numUVs; j++) {
-				texCoords[j].push_back(readFloat32(rw));
-				texCoords[j].push_back(readFloat32(rw));
-			}
+static uint32 align16(uint32 n)
+{
+	return (n + 0xF) & ~0xF;
+}
+
+uint32 Geometry::writeXboxNativeSkin(ostream &rw)
+{
+	uint32 vertexCount = vertices.size()/3;
+
+	/* only as many weights as any vertex uses */
+	uint32 numWeights = 1;
+	for (uint32 i = 0; i < vertexCount; i++)
+		for (uint32 j = numWeights; j < 4; j++)
+			if (vertexBoneWeights[i*4+j] != 0.0f)
+				numWeights = j+1;
+
+	// tab1 maps indices to bones tab2 maps bones to indices
+	int32 boneTab1[0x100];
+	int32 boneTab2[0x100];
+	for (uint32 i = 0; i < 0x100; i++) {
+		boneTab1[i] = 0;
+		boneTab2[i] = -1;
+	}
+	for (uint32 i = 0; i < vertexCount; i++)
+		for (uint32 j = 0; j < numWeights; j++)
+			boneTab2[vertexBoneIndices[i] >> j*8 & 0xFF] = 0;
+	uint32 usedBones = 0;
+	for (uint32 i = 0; i < 0x100; i++)
+		if (boneTab2[i] == 0) {
+			boneTab1[usedBones] = i;
+			boneTab2[i] = usedBones++;
 		}
+	uint32 skinHeader[4] = { usedBones, numWeights, 0, 3*numWeights };
+
+	HeaderInfo header;
+	header.build = version;
+	header.type = CHUNK_STRUCT;
+	header.length = 8 + 2*0x100*sizeof(int32) + 4*sizeof(uint32) +
+	                vertexCount*3*numWeights + boneCount*0x10*sizeof(float32);
+	uint32 bytesWritten = header.write(rw);
+
+	bytesWritten += writeUInt32(PLATFORM_XBOX, rw);
+	bytesWritten += writeUInt32(boneCount, rw);
+	rw.write((char *) boneTab1, 0x100*sizeof(int32));
+	rw.write((char *) boneTab2, 0x100*sizeof(int32));
+	rw.write((char *) skinHeader, 4*sizeof(uint32));
+	bytesWritten += 2*0x100*sizeof(int32) + 4*sizeof(uint32);
 
-		if (!compNormal) {
-			normals[i*3+0] = readFloat32(rw);
-			normals[i*3+1] = readFloat32(rw);
-			normals[i*3+2] = readFloat32(rw);
+	vector<uint8> data(vertexCount*3*numWeights);
+	uint8 *p = data.size() ? &data[0] : 0;
+	for (uint32 i = 0; i < vertexCount; i++) {
+		for (uint32 j = 0; j < numWeights; j++) {
+			float32 w = vertexBoneWeights[i*4+j]*255.0f + 0.5f;
+			*p++ = w < 0.0f ? 0 : w > 255.0f ? 255 : (uint8) w;
+		}
+		for (uint32 j = 0; j < numWeights; j++) {
+			uint32 bone = vertexBoneIndices[i] >> j*8 & 0xFF;
+			uint16 index = boneTab2[bone]*3;
+			memcpy(p, &index, 2);
+			p += 2;
 		}
 	}
+	if (data.size() > 0)
+		rw.write((char *) &data[0], data.size());
+	bytesWritten += data.size();
+
+	rw.write((char *) (&inverseMatrices[0]),
+	         boneCount*0x10*sizeof(float32));
+	bytesWritten += boneCount*0x10*sizeof(float32);
+
+	return bytesWritten;
+}
+
+uint32 Geometry::writeXboxNativeData(ostream &rw)
+{
+	uint32 vertexCount = vertices.size()/3;
+
+	XboxLayout layout;
+	computeXboxLayout(layout, flags, numUVs, 0);
+	/* 0x28 would be read as float normals */
+	if (layout.stride == 0x28 && layout.compNormal >= 0)
+		computeXboxLayout(layout, flags, numUVs, 0x2C);
+
+	vector<uint8> data(vertexCount*layout.stride, 0);
+	if (vertexCount > 0)
+		encodeXboxVertices(&data[0], layout, *this, vertexCount);
+
+	/* offsets relative to the block start */
+	uint32 indexStart = 28 + 24*splits.size();
+	uint32 vertexStart = indexStart;
+	for (uint32 i = 0; i < splits.size(); i++)
+		vertexStart = align16(vertexStart) +
+		              splits[i].indices.size()*sizeof(uint16);
+	vertexStart = align16(vertexStart);
+
+	uint32 structSize = 4 + 8 + vertexStart + data.size();
+
+	HeaderInfo header;
+	header.build = version;
+	header.type = CHUNK_NATIVEDATA;
+	header.length = 12 + structSize;
+	uint32 bytesWritten = header.write(rw);
+	header.type = CHUNK_STRUCT;
+	header.length = structSize;
+	bytesWritten += header.write(rw);
+
+	bytesWritten += writeUInt32(PLATFORM_XBOX, rw);
+	/* relative to this field */
+	bytesWritten += writeUInt32(8 + vertexStart, rw);
+	bytesWritten += writeUInt16(0, rw);
+	bytesWritten += writeUInt16(splits.size(), rw);
+
+	/* Header */
+	char zero[0x10];
+	memset(zero, 0, 0x10);
+	bytesWritten += writeUInt32(faceType == FACETYPE_STRIP ? 2 : 1, rw);
+	bytesWritten += writeUInt32(vertexCount, rw);
+	bytesWritten += writeUInt32(layout.stride, rw);
+	rw.write(zero, 16);
+	bytesWritten += 16;
+
+	/* Splits */
+	for (uint32 i = 0; i < splits.size(); i++) {
+		rw.write(zero, 8);
+		bytesWritten += 8;
+		bytesWritten += writeUInt32(splits[i].indices.size(), rw);
+		rw.write(zero, 12);
+		bytesWritten += 12;
+	}
+
+	/* Indices */
+	uint32 pos = indexStart;
+	vector<uint16> indices;
+	for (uint32 i = 0; i < splits.size(); i++) {
+		rw.write(zero, align16(pos) - pos);
+		bytesWritten += align16(pos) - pos;
+		pos = align16(pos);
+		uint32 n = splits[i].indices.size();
+		indices.resize(n);
+		for (uint32 j = 0; j < n; j++)
+			indices[j] = splits[i].indices[j];
+		if (n > 0)
+			rw.write((char *) &indices[0], n*sizeof(uint16));
+		bytesWritten += n*sizeof(uint16);
+		pos += n*sizeof(uint16);
+	}
+	rw.write(zero, vertexStart - pos);
+	bytesWritten += vertexStart - pos;
+
+	/* Vertices */
+	if (data.size() > 0)
+		rw.write((char *) &data[0], data.size());
+	bytesWritten += data.size();
+
+	return bytesWritten;
 }
 
 }